@@ -22,6 +22,7 @@
 #define BPM_PROTOCOL_PUBLISHER_UDP_PORT      7074
 
 #define BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY  1440
+#define BPM_PROTOCOL_WAVEFORM_MAX_PAYLOAD_CAPACITY  8944 /* 9000 byte MTU */
 #define BPM_PROTOCOL_STRING_CAPACITY            24
 #define BPM_PROTOCOL_FOFB_CAPACITY              512
 #define BPM_PROTOCOL_RECORDER_COUNT             5
@@ -33,7 +34,14 @@
 #define BPM_PROTOCOL_MAGIC_WAVEFORM_HEADER   0xCAFE0005
 #define BPM_PROTOCOL_MAGIC_WAVEFORM_DATA     0xCAFE0006
 #define BPM_PROTOCOL_MAGIC_WAVEFORM_ACK      0xCAFE0007
+#define BPM_PROTOCOL_MAGIC_WAVEFORM_WINDOW_ACK 0xCAFE0008
+#define BPM_PROTOCOL_MAGIC_WAVEFORM_ENVELOPE 0xCAFE0009
 #define BPM_PROTOCOL_MAGIC_FILTER_UPDATE     0xCAFE000A
+#define BPM_PROTOCOL_MAGIC_WAVEFORM_COMPRESSED_DATA 0xCAFE000B
+#define BPM_PROTOCOL_MAGIC_FA_STREAM         0xCAFE000C
+#define BPM_PROTOCOL_MAGIC_BATCH_COMMAND     0xCAFE000D
+#define BPM_PROTOCOL_MAGIC_BATCH_REPLY       0xCAFE000E
+#define BPM_PROTOCOL_MAGIC_SETTINGS_SNAPSHOT 0xCAFE000F
 
 /*
  * Subcommand structure
@@ -59,6 +67,46 @@
 #define BPM_PROTOCOL_COMMAND_IO_LATCH_CLEAR   12
 #define BPM_PROTOCOL_COMMAND_IO_TBT_SUM_SHIFT 13
 #define BPM_PROTOCOL_COMMAND_IO_MT_SUM_SHIFT  14
+#define BPM_PROTOCOL_COMMAND_IO_SA_HISTOGRAM  15 /* Write clears */
+#define BPM_PROTOCOL_COMMAND_IO_PROFILE       16 /* Write clears */
+#define BPM_PROTOCOL_COMMAND_IO_SETTINGS      17 /* Read-only */
+
+/*
+ * Slow acquisition publication histograms
+ * The BPM_PROTOCOL_COMMAND_IO_SA_HISTOGRAM value is the histogram number
+ * times 256 plus the bin number and the reply is the count in that bin.
+ * Latency bins start at 0, interval bins (actual less nominal) start at
+ * -(BIN_COUNT/2)*BIN_WIDTH.  The first and last bins also hold values
+ * out of range.
+ */
+#define BPM_PROTOCOL_SA_HISTOGRAM_LATENCY     0
+#define BPM_PROTOCOL_SA_HISTOGRAM_INTERVAL    1
+#define BPM_PROTOCOL_SA_HISTOGRAM_BIN_COUNT   64
+#define BPM_PROTOCOL_SA_HISTOGRAM_BIN_WIDTH   100 /* microseconds */
+
+/*
+ * Execution time profile
+ * The BPM_PROTOCOL_COMMAND_IO_PROFILE value is the profile point number
+ * times 256 plus the item number.  The name of a point beyond the last
+ * is an empty string.  Times are in processor clock cycles.
+ * Bin 0 holds times below 128 cycles, bin n (0<n<BIN_COUNT-1) holds
+ * times from 64<<n to 128<<n cycles and the last bin holds the rest.
+ */
+#define BPM_PROTOCOL_PROFILE_ITEM_NAME        0 /* Reply is a string */
+#define BPM_PROTOCOL_PROFILE_ITEM_COUNT       1
+#define BPM_PROTOCOL_PROFILE_ITEM_CYCLES_LO   2
+#define BPM_PROTOCOL_PROFILE_ITEM_CYCLES_HI   3
+#define BPM_PROTOCOL_PROFILE_ITEM_MAX_CYCLES  4
+#define BPM_PROTOCOL_PROFILE_ITEM_BIN_0       16
+#define BPM_PROTOCOL_PROFILE_BIN_COUNT        16
+
+/*
+ * Settings snapshot
+ * A BPM_PROTOCOL_COMMAND_IO_SETTINGS command packet is answered with a
+ * bpmSettingsSnapshot packet rather than a bpmReply.  Within a batch the
+ * reply value is the snapshot version.
+ */
+#define BPM_PROTOCOL_SETTINGS_VERSION         1
 
 /*
  * Waveform recorder commands
@@ -70,7 +118,15 @@
 #define BPM_PROTOCOL_COMMAND_WF_PRETRIGGER_COUNT    0x20
 #define BPM_PROTOCOL_COMMAND_WF_ACQUISITION_COUNT   0x30
 #define BPM_PROTOCOL_COMMAND_WF_ACQUISITION_MODE    0x40
+#define BPM_PROTOCOL_COMMAND_WF_PRIORITY            0x50
+#define BPM_PROTOCOL_COMMAND_WF_BYTES_SENT          0x60 /* Write clears */
+#define BPM_PROTOCOL_COMMAND_WF_ENVELOPE_POINTS     0x70 /* 0 disables */
+#define BPM_PROTOCOL_COMMAND_WF_ROI_FIRST_SAMPLE    0x80
+#define BPM_PROTOCOL_COMMAND_WF_ROI_SAMPLE_COUNT    0xA0 /* Write starts */
+#define BPM_PROTOCOL_COMMAND_WF_ROI_CHANNEL_MASK    0xB0
 #define BPM_PROTOCOL_COMMAND_WF_SOFT_TRIGGER        0x90
+#define BPM_PROTOCOL_COMMAND_WF_STREAM              0xC0
+#define BPM_PROTOCOL_COMMAND_WF_SEGMENT_COUNT       0xD0 /* 0 or 1 disables */
 
 /*
  * Per-ADC values
@@ -114,6 +170,33 @@ struct bpmReply {
     }                   u;
 };
 
+/*
+ * Batched commands
+ * Each (code, value) pair is processed as if it had arrived in its own
+ * command packet.  Packets are sent with only 'count' items present.
+ * The reply carries the numeric value of each item's reply in order.
+ * The header matches that of a bpmCommand with 'count' in place of 'code'.
+ */
+#define BPM_PROTOCOL_BATCH_CAPACITY 128
+struct bpmBatchCommand {
+    epicsUInt32 magic;
+    epicsUInt32 commandNumber;
+    epicsUInt16 count;
+    epicsUInt16 pad;
+    struct bpmBatchItem {
+        epicsUInt16 code;
+        epicsUInt16 pad;
+        epicsUInt32 value;
+    }           items[BPM_PROTOCOL_BATCH_CAPACITY];
+};
+struct bpmBatchReply {
+    epicsUInt32 magic;
+    epicsUInt32 commandNumber;
+    epicsUInt16 count;
+    epicsUInt16 pad;
+    epicsUInt32 values[BPM_PROTOCOL_BATCH_CAPACITY];
+};
+
 /*
  * Low speed system monitoring
  */
@@ -146,6 +229,12 @@ struct bpmSystemMonitor {
     epicsUInt16 sfpRxPower[BPM_PROTOCOL_SFP_COUNT];
     epicsUInt32 crcFaultsCCW;
     epicsUInt32 crcFaultsCW;
+    epicsInt32  saLatencyP50;       /* Microseconds */
+    epicsInt32  saLatencyP99;
+    epicsInt32  saLatencyMax;
+    epicsInt32  saIntervalP50;      /* Microseconds from nominal */
+    epicsInt32  saIntervalP99;
+    epicsInt32  saIntervalMax;
 };
 
 /*
@@ -179,21 +268,93 @@ struct bpmSlowAcquisition {
     epicsInt32  yRMSnarrow;
 };
 
+/*
+ * Subscription request
+ * An IOC subscribes by sending its FOFB index alone, or by sending this
+ * structure to also request a waveform data block size other than the
+ * default BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY.  The block size is
+ * rounded down to a multiple of 16 bytes and limited to
+ * BPM_PROTOCOL_WAVEFORM_MAX_PAYLOAD_CAPACITY.  A value of 0 selects the
+ * default.  Large blocks require a network supporting jumbo frames.
+ */
+struct bpmSubscription {
+    epicsInt16  fofbIndex;
+    epicsUInt16 waveformPayloadCapacity;
+    epicsUInt32 options;    /* Optional */
+};
+#define BPM_PROTOCOL_SUBSCRIBE_WAVEFORM_COMPRESSION 0x1
+
 /*
  * Waveform transfer
  * When a waveform recorder completes acquisition it sends the header
  * unsolicited.  It then sends each block when requested.
  * The header is retransmitted if a block request does not arrive in a
  * reasonable interval.
+ *
+ * An IOC that replies to the header with a window acknowledgement rather
+ * than a plain acknowledgement selects windowed transfer.  The BPM then
+ * keeps up to windowSize blocks in flight.  Each window acknowledgement
+ * carries the number of the first block not yet received along with a
+ * bitmap of the blocks beyond that which have been received.  Holes in
+ * the bitmap are resent once.  If no acknowledgement arrives in a
+ * reasonable interval every unacknowledged block is resent.
+ *
+ * Every data packet other than the last carries blockSize bytes.  The
+ * payload array below is sized for the default block size; an IOC that
+ * requests larger blocks must provide a correspondingly larger buffer.
+ *
+ * When the subscriber has requested compression the header block size
+ * has BPM_PROTOCOL_WAVEFORM_BLOCK_COMPRESSED set and any block that
+ * compresses to fewer bytes than it started with is sent with the
+ * compressed data magic number.  Each such block covers exactly the same
+ * range of bytes it would had it not been compressed.  The compressed
+ * format is described in waveformCompress.c which also provides the
+ * reference decoder.
  */
+#define BPM_PROTOCOL_WAVEFORM_BLOCK_COMPRESSED  0x8000
 struct bpmWaveformHeader {
     epicsUInt32 magic;
     epicsUInt32 waveformNumber;
     epicsUInt16 recorderNumber;
+    epicsUInt16 blockSize;
     epicsUInt32 seconds;
     epicsUInt32 ticks;
     epicsUInt32 byteCount;
 };
+
+/*
+ * Region of interest transfer
+ * Writing the sample count starts a transfer of the given range of
+ * samples of the most recent acquisition.  Only those channels whose
+ * bits are set in the channel mask are sent, packed in channel order.
+ * The header is extended to describe the region.
+ */
+struct bpmWaveformRoiHeader {
+    struct bpmWaveformHeader header;
+    epicsUInt32 firstSample;
+    epicsUInt32 sampleCount;
+    epicsUInt32 channelMask;
+};
+
+/*
+ * Segmented acquisition
+ * A recorder other than the ADC recorder given a segment count greater
+ * than 1 captures that many consecutive triggered acquisitions, each of
+ * the configured pretrigger and acquisition counts, on a single arm.
+ * The segments are sent as one waveform, one after the other, with an
+ * extended header giving the time stamp of each segment's trigger.
+ * The segment count may be reduced to fit the recorder memory.
+ */
+#define BPM_PROTOCOL_SEGMENT_CAPACITY   64
+struct bpmWaveformSegmentHeader {
+    struct bpmWaveformHeader header;
+    epicsUInt32 segmentCount;
+    epicsUInt32 samplesPerSegment;
+    struct {
+        epicsUInt32 seconds;
+        epicsUInt32 ticks;
+    }           segment[BPM_PROTOCOL_SEGMENT_CAPACITY];
+};
 struct bpmWaveformData {
     epicsUInt32 magic;
     epicsUInt32 waveformNumber;
@@ -207,6 +368,103 @@ struct bpmWaveformAck {
     epicsUInt32 recorderNumber;
     epicsUInt32 blockNumber;
 };
+#define BPM_PROTOCOL_WAVEFORM_WINDOW_CAPACITY   256
+struct bpmWaveformWindowAck {
+    epicsUInt32 magic;
+    epicsUInt32 waveformNumber;
+    epicsUInt32 recorderNumber;
+    epicsUInt32 blockNumber;    /* All blocks before this have arrived */
+    epicsUInt32 windowSize;
+    epicsUInt32 sack[BPM_PROTOCOL_WAVEFORM_WINDOW_CAPACITY/32]; /* Bit n set */
+                                          /* if block blockNumber+1+n arrived */
+};
+
+/*
+ * Waveform envelope preview
+ * When a recorder has been given a non-zero envelope point count the
+ * acquired waveform is divided into that many contiguous runs of
+ * samplesPerPoint samples (the final run may be shorter) and the
+ * minimum, maximum and mean of each channel over each run is sent,
+ * unsolicited and unacknowledged, before the waveform header.
+ * ADC recorder values are sign-extended to 32 bits.
+ * The envelope point count is limited to BPM_PROTOCOL_ENVELOPE_POINT_LIMIT.
+ */
+#define BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT     4
+#define BPM_PROTOCOL_ENVELOPE_POINTS_PER_PACKET 30
+#define BPM_PROTOCOL_ENVELOPE_POINT_LIMIT       120
+struct bpmEnvelopePoint {
+    epicsInt32  min;
+    epicsInt32  max;
+    epicsInt32  mean;
+};
+struct bpmWaveformEnvelope {
+    epicsUInt32 magic;
+    epicsUInt32 waveformNumber;
+    epicsUInt16 recorderNumber;
+    epicsUInt16 pointCount;         /* Points in this packet */
+    epicsUInt32 firstPoint;
+    epicsUInt32 totalPoints;
+    epicsUInt32 samplesPerPoint;
+    epicsUInt32 seconds;
+    epicsUInt32 ticks;
+    struct bpmEnvelopePoint point[BPM_PROTOCOL_ENVELOPE_POINTS_PER_PACKET]
+                                 [BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT];
+};
+
+/*
+ * Continuous fast acquisition stream
+ * Writing a non-zero samples-per-packet value to the fast acquisition
+ * recorder stream command starts the recorder free-running and sends
+ * every sample it writes, unsolicited and unacknowledged, in packets
+ * of that many samples.  Writing 0 stops the stream.  The recorder
+ * can not be armed for triggered acquisition while it is streaming.
+ * The samples-per-packet value is limited to the waveform block size
+ * divided by the 16 bytes per sample.  The sample array below is sized
+ * for the default number of samples per packet.
+ *
+ * Packet numbers and sample numbers are consecutive so a subscriber
+ * can detect lost packets.  Samples are evrPerFaMarker event receiver
+ * ticks apart.  The time stamp is that of the first sample, worked
+ * back from the time at which the processor found the most recent
+ * sample in memory.  It lags the acquisition by a varying amount,
+ * typically less than a millisecond.  Without an event clock the
+ * time stamp is that at which the most recent sample was found.
+ */
+#define BPM_PROTOCOL_FA_STREAM_SAMPLE_CAPACITY  80
+struct bpmFaStream {
+    epicsUInt32 magic;
+    epicsUInt32 packetNumber;
+    epicsUInt32 firstSample;
+    epicsUInt16 sampleCount;
+    epicsUInt16 pad;
+    epicsUInt32 seconds;
+    epicsUInt32 ticks;
+    epicsInt32  sample[BPM_PROTOCOL_FA_STREAM_SAMPLE_CAPACITY][4];
+};
+
+/*
+ * Snapshot of all settable values
+ * Each entry holds the value that would be returned by reading the
+ * corresponding command.  IOPOINT entries are indexed by command number,
+ * recorder entries by command code divided by 16.  Entries that are not
+ * settings read as 0.
+ */
+#define BPM_PROTOCOL_SETTINGS_IO_CAPACITY       16
+#define BPM_PROTOCOL_SETTINGS_RECORDER_CAPACITY 16
+#define BPM_PROTOCOL_SETTINGS_EVENT_CAPACITY    256
+#define BPM_PROTOCOL_SETTINGS_TRIGGER_CAPACITY  8
+struct bpmSettingsSnapshot {
+    epicsUInt32 magic;
+    epicsUInt32 commandNumber;
+    epicsUInt16 version;
+    epicsUInt16 pad;
+    epicsUInt32 io[BPM_PROTOCOL_SETTINGS_IO_CAPACITY];
+    epicsUInt32 gain[BPM_PROTOCOL_ADC_COUNT];
+    epicsUInt32 recorder[BPM_PROTOCOL_RECORDER_COUNT]
+                                    [BPM_PROTOCOL_SETTINGS_RECORDER_CAPACITY];
+    epicsUInt32 triggerDelay[BPM_PROTOCOL_SETTINGS_TRIGGER_CAPACITY];
+    epicsUInt8  eventTrigger[BPM_PROTOCOL_SETTINGS_EVENT_CAPACITY];
+};
 
 /*
  * Filter coeffiient update
@@ -13,9 +13,12 @@
 #include "cellStreamFilter.h"
 #include "evr.h"
 #include "gpio.h"
+#include "profile.h"
+#include "publisher.h"
 #include "systemParameters.h"
 #include "tftp.h"
 #include "util.h"
+#include "waveformRecorder.h"
 
 enum consoleMode { consoleModeCommand,
                    consoleModeLogReplay,
@@ -308,7 +311,40 @@ cmdMAC(int argc, char **argv)
 static int
 cmdSTATS(int argc, char **argv)
 {
+    if ((argc > 1) && (strcasecmp(argv[1], "clear") == 0)) {
+        publisherSaHistogramClear();
+        return 0;
+    }
     stats_display();
+    publisherShowStatistics((argc > 1) && (strcasecmp(argv[1], "hist") == 0));
+    return 0;
+}
+
+static int
+cmdPROF(int argc, char **argv)
+{
+    if ((argc > 1) && (strcasecmp(argv[1], "clear") == 0)) {
+        profileClear();
+        return 0;
+    }
+    profileShow((argc > 1) && (strcasecmp(argv[1], "hist") == 0));
+    return 0;
+}
+
+static int
+cmdTASKS(int argc, char **argv)
+{
+    schedShowStatistics((argc > 1) && (strcasecmp(argv[1], "clear") == 0));
+    return 0;
+}
+
+static int
+cmdWFR(int argc, char **argv)
+{
+    if ((argc > 1) && (strcasecmp(argv[1], "bench") == 0))
+        wfrCompressionBenchmark();
+    else
+        wfrShowStatistics();
     return 0;
 }
 
@@ -353,8 +389,11 @@ static struct commandInfo commandTable[] = {
   { "log",   cmdLOG,   "Replay startup console output"      },
   { "mac",   cmdMAC,   "Set Ethernet MAC address"           },
   { "net",   cmdNET,   "Set network parameters"             },
+  { "prof",  cmdPROF,  "Show execution time profile"        },
   { "reg",   cmdREG,   "Show GPIO register(s)"              },
   { "stats", cmdSTATS, "Show network statistics"            },
+  { "tasks", cmdTASKS, "Show task runtime statistics"       },
+  { "wfr",   cmdWFR,   "Show waveform transfer statistics"  },
 };
 static void
 commandCallback(int argc, char **argv)
@@ -424,15 +463,19 @@ void
 console_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
                                       struct ip_addr *fromAddr, u16_t fromPort)
 {
+    uint32_t then = sysTicksSinceBoot();
+
     /* Silently ignore runt packets and overruns */
     if ((p->len == 0) || (udpConsole.pbufIn != NULL)) {
         pbuf_free(p);
-        return;
     }
-    udpConsole.fromAddr = *fromAddr;
-    udpConsole.fromPort = fromPort;
-    udpConsole.pbufIn = p;
-    udpConsole.inIndex = 0;
+    else {
+        udpConsole.fromAddr = *fromAddr;
+        udpConsole.fromPort = fromPort;
+        udpConsole.pbufIn = p;
+        udpConsole.inIndex = 0;
+    }
+    profileEnd(PROFILE_CONSOLE_CALLBACK, then);
 }
 
 /*
@@ -42,6 +42,7 @@
 #define GPIO_IDX_POSITION_CALC_SA_Y 25 // Slow acquisition Y position
 #define GPIO_IDX_POSITION_CALC_SA_Q 26 // Slow acquisition skew
 #define GPIO_IDX_POSITION_CALC_SA_S 27 // Slow acquisition sum
+#define GPIO_IDX_SA_SNAPSHOT_SEQUENCE 28 // Count slow acquisition updates
 
 #define GPIO_IDX_SA_TIMESTAMP_SEC   30 // Slow acquisition time stamp
 #define GPIO_IDX_SA_TIMESTAMP_TICKS 31 // Slow acquisition time stamp
@@ -3,15 +3,58 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <xilflash.h>
 #include <xparameters.h>
 #include "linearFlash.h"
 #include "util.h"
 
-#define PAGESIZE    (128*1024)
+#define PAGESIZE    LINEAR_FLASH_PAGE_SIZE
+
+/*
+ * Non-blocking routines added to xilflash_intel.c
+ */
+int XFlashIntel_EraseStart(XFlash *InstancePtr, u32 Offset);
+int XFlashIntel_WriteBufferStart(XFlash *InstancePtr, u32 Offset,
+                                 void *SrcPtr, u32 Bytes);
+int XFlashIntel_Poll(XFlash *InstancePtr, u32 Offset);
 
 static XFlash f;
 
+/*
+ * Write queue
+ * Data to be written is staged a page at a time.  Erase and program
+ * operations are started and polled for completion from the main loop
+ * so the network isn't blocked while the flash is busy.  Writes that
+ * continue where the newest page left off are appended to that page.
+ * Only whole write buffers of the newest page are programmed, even when
+ * the queue is flushed, so writes may still be appended after a flush.
+ * A partially filled write buffer at the end of the newest page is
+ * programmed only when the queue is drained.  This ensures that no
+ * write buffer is programmed more than once.
+ * A page that would be erased is first compared with the flash and left
+ * alone if erasing and programming it would not change its contents.
+ */
+#define PAGE_QUEUE_CAPACITY 4
+static struct page {
+    unsigned int address;       /* Flash address of start of page */
+    unsigned int end;           /* Offset beyond last staged byte */
+    unsigned int programmed;    /* Offset beyond last programmed byte */
+    int          needErase;
+    unsigned int compared;      /* Offset beyond last compared byte */
+    int          differs;
+    char         data[PAGESIZE] __attribute__((aligned(4)));
+} pageQueue[PAGE_QUEUE_CAPACITY];
+static unsigned int pageHead, pageTail;
+static int isFlushing, isDraining;
+static enum { FS_IDLE, FS_ERASING, FS_PROGRAMMING } flashState;
+static unsigned int opAddress, opLength;
+static unsigned int writeBufferSize = 2;
+static int writeErrors;
+static unsigned int pagesWritten, pagesSkipped;
+
+#define COMPARE_CHUNK   (8*1024)    /* Limit time spent in each check */
+
 int
 linearFlashInit(void)
 {
@@ -57,6 +100,9 @@ linearFlashInit(void)
         parms.PropertiesParam.PropertiesPtr->TimeMax.EraseChip_Ms);
     xil_printf("    ProgCap.WriteBufferSize = 0x%x\n\r",
         parms.PropertiesParam.PropertiesPtr->ProgCap.WriteBufferSize);
+    if (parms.PropertiesParam.PropertiesPtr->ProgCap.WriteBufferSize > 0)
+        writeBufferSize =
+                    parms.PropertiesParam.PropertiesPtr->ProgCap.WriteBufferSize;
     xil_printf("    ProgCap.WriteBufferAlignMask = 0x%x\n\r",
         parms.PropertiesParam.PropertiesPtr->ProgCap.WriteBufferAlignmentMask);
     xil_printf("    ProgCap.EraseQueueSize = 0x%x\n\r",
@@ -103,6 +149,7 @@ linearFlashRead(unsigned int address, char *buf, unsigned int nBytes)
 {
     int i;
 
+    linearFlashDrain();
     i = XFlash_Read(&f, address, nBytes, buf);
     if (i != XST_SUCCESS) {
         xil_printf("XFlash_Reade(0x%x,%d) failed: %d\r\n", address, nBytes, i);
@@ -111,33 +158,325 @@ linearFlashRead(unsigned int address, char *buf, unsigned int nBytes)
     return nBytes;
 }
 
+static struct page *
+newestPage(void)
+{
+    if (pageHead == pageTail)
+        return NULL;
+    return &pageQueue[(pageHead - 1) % PAGE_QUEUE_CAPACITY];
+}
+
+/*
+ * See if a write can be appended to the newest page
+ */
+static int
+canAppend(struct page *pp, unsigned int address)
+{
+    unsigned int offset = address % PAGESIZE;
+
+    return ((pp != NULL)
+         && !isDraining
+         && (offset != 0)
+         && (pp->address == (address - offset))
+         && (pp->end == offset));
+}
+
+/*
+ * Offset beyond the last whole write buffer of a page
+ */
+static unsigned int
+wholeBufferEnd(const struct page *pp)
+{
+    return pp->end - ((pp->address + pp->end) % writeBufferSize);
+}
+
+/*
+ * Nonzero if the page at the head of the queue is the newest
+ * page and may still have writes appended to it.
+ */
+static int
+tailIsOpen(void)
+{
+    return ((pageTail + 1) == pageHead) && !isDraining;
+}
+
+/*
+ * Stage data that lies within a single page
+ */
+static void
+stage(unsigned int address, const char *buf, unsigned int nBytes,
+      int needErase)
+{
+    unsigned int offset = address % PAGESIZE;
+    struct page *pp = newestPage();
+
+    if (!needErase && canAppend(pp, address)) {
+        /* Comparison beyond the old end was against erased flash */
+        if (pp->compared > offset)
+            pp->compared = offset;
+        isFlushing = 0;
+    }
+    else {
+        pp = &pageQueue[pageHead % PAGE_QUEUE_CAPACITY];
+        pp->address = address - offset;
+        pp->end = pp->programmed = offset;
+        pp->needErase = needErase;
+        pp->compared = 0;
+        pp->differs = 0;
+        pageHead++;
+        isFlushing = 0;
+    }
+    memcpy(pp->data + offset, buf, nBytes);
+    pp->end += nBytes;
+}
+
+/*
+ * Queue a write
+ * A page is erased before it is written if the write starts at the
+ * beginning of the page or crosses into it from the previous page.
+ * Returns the number of bytes queued, 0 if there's no room in the queue,
+ * or -1 if the request is invalid or an earlier queued write failed.
+ */
 int
-linearFlashWrite(unsigned int address, const char *buf, unsigned int nBytes)
+linearFlashQueueWrite(unsigned int address, const char *buf, unsigned int nBytes)
 {
     unsigned int loPage = address / PAGESIZE;
     unsigned int hiPage = (address + nBytes - 1) / PAGESIZE;
-    int i;
+    unsigned int pagesNeeded = 0, loCount;
+    struct page *pp = newestPage();
 
     if (nBytes == 0)
         return 0;
-    if (nBytes > PAGESIZE)
+    if ((nBytes > PAGESIZE) || writeErrors)
         return -1;
-    if (((address % PAGESIZE) == 0) || (hiPage != loPage)) {
-        i = XFlash_Unlock(&f, hiPage * PAGESIZE, PAGESIZE);
-        if (i != XST_SUCCESS) {
-            xil_printf("XFlash_Unlock page %d failed: %d\r\n", hiPage, i);
-            return -1;
+    if (!canAppend(pp, address))
+        pagesNeeded++;
+    if (hiPage != loPage)
+        pagesNeeded++;
+    if (((pageHead - pageTail) + pagesNeeded) > PAGE_QUEUE_CAPACITY)
+        return 0;
+    loCount = nBytes;
+    if (hiPage != loPage)
+        loCount = (hiPage * PAGESIZE) - address;
+    stage(address, buf, loCount, ((address % PAGESIZE) == 0));
+    if (loCount != nBytes)
+        stage(hiPage * PAGESIZE, buf + loCount, nBytes - loCount, 1);
+    return nBytes;
+}
+
+static void
+writeFailed(const char *op, unsigned int address, int status)
+{
+    xil_printf("Flash %s 0x%x failed: %d\r\n", op, address, status);
+    writeErrors++;
+    pageTail++;
+    flashState = FS_IDLE;
+}
+
+/*
+ * Compare the next chunk of a page with the current flash contents.
+ * Bytes beyond the staged data would be erased so must already be erased.
+ */
+static void
+compareChunk(struct page *pp)
+{
+    const unsigned char *flash = (const unsigned char *)
+                        (XPAR_LINEAR_FLASH_S_AXI_MEM0_BASEADDR + pp->address);
+    unsigned int stop = pp->compared + COMPARE_CHUNK;
+    unsigned int i;
+
+    if (stop > PAGESIZE)
+        stop = PAGESIZE;
+    if (pp->compared < pp->end) {
+        i = (stop < pp->end) ? stop : pp->end;
+        if (memcmp(pp->data + pp->compared, flash + pp->compared,
+                                                    i - pp->compared) != 0)
+            pp->differs = 1;
+        pp->compared = i;
+    }
+    for (i = pp->compared ; !pp->differs && (i < stop) ; i++) {
+        if (flash[i] != 0xFF)
+            pp->differs = 1;
+    }
+    pp->compared = pp->differs ? PAGESIZE : stop;
+}
+
+/*
+ * Advance the write queue
+ * Called from the main loop.
+ */
+void
+linearFlashCheck(void)
+{
+    struct page *pp;
+    unsigned int limit;
+    int status;
+
+    if (pageHead == pageTail)
+        return;
+    pp = &pageQueue[pageTail % PAGE_QUEUE_CAPACITY];
+    if (flashState != FS_IDLE) {
+        status = XFlashIntel_Poll(&f, opAddress);
+        if (status == XFLASH_BUSY)
+            return;
+        if (status != XFLASH_READY) {
+            writeFailed(flashState == FS_ERASING ? "erase" : "program",
+                                                            opAddress, status);
+            return;
+        }
+        if (flashState == FS_ERASING)
+            pp->needErase = 0;
+        else
+            pp->programmed += opLength;
+        flashState = FS_IDLE;
+    }
+    if (pp->needErase) {
+        /*
+         * Wait until the page is complete then skip it if it's unchanged
+         */
+        if (tailIsOpen() && !isFlushing)
+            return;
+        if (pp->compared < PAGESIZE) {
+            compareChunk(pp);
+            return;
         }
-        i = XFlash_Erase(&f, hiPage * PAGESIZE, PAGESIZE);
-        if (i != XST_SUCCESS) {
-            xil_printf("XFlash_Erase page %d failed: %d\r\n", hiPage, i);
-            return -1;
+        if (!pp->differs) {
+            if (tailIsOpen())
+                return;
+            pagesSkipped++;
+            pageTail++;
+            return;
         }
+        pagesWritten++;
+        status = XFlash_Unlock(&f, pp->address, PAGESIZE);
+        if (status != XST_SUCCESS) {
+            writeFailed("unlock", pp->address, status);
+            return;
+        }
+        status = XFlashIntel_EraseStart(&f, pp->address);
+        if (status != XST_SUCCESS) {
+            writeFailed("erase", pp->address, status);
+            return;
+        }
+        opAddress = pp->address;
+        flashState = FS_ERASING;
+        return;
     }
-    i = XFlash_Write(&f, address, nBytes, (char *)buf);
-    if (i != XST_SUCCESS) {
-        xil_printf("XFlash_Write(0x%x,%d) failed: %d\r\n", address, nBytes, i);
-        return -1;
+
+    /*
+     * Program only whole write buffers of a page that may still grow
+     */
+    limit = tailIsOpen() ? wholeBufferEnd(pp) : pp->end;
+    if (pp->programmed < limit) {
+        opAddress = pp->address + pp->programmed;
+        opLength = writeBufferSize - (opAddress % writeBufferSize);
+        if (opLength > (limit - pp->programmed))
+            opLength = limit - pp->programmed;
+        status = XFlashIntel_WriteBufferStart(&f, opAddress,
+                                    pp->data + pp->programmed, opLength);
+        if (status != XST_SUCCESS) {
+            writeFailed("program", opAddress, status);
+            return;
+        }
+        flashState = FS_PROGRAMMING;
+        return;
     }
+    if ((pp->programmed == pp->end) && !tailIsOpen())
+        pageTail++;
+}
+
+/*
+ * Report, then clear, the number of pages erased and programmed
+ * and the number skipped because they were unchanged.
+ */
+void
+linearFlashStatistics(unsigned int *written, unsigned int *skipped)
+{
+    *written = pagesWritten;
+    *skipped = pagesSkipped;
+    pagesWritten = 0;
+    pagesSkipped = 0;
+}
+
+/*
+ * Nonzero while queued writes remain that a flush will complete.
+ * Once the queue is flushed it is no longer busy when all that
+ * remains is a partial write buffer at the end of the newest page,
+ * or a newest page found to be unchanged.  Draining the queue
+ * finishes those.
+ */
+int
+linearFlashBusy(void)
+{
+    struct page *pp;
+
+    if (pageHead == pageTail)
+        return 0;
+    if (!isFlushing || !tailIsOpen() || (flashState != FS_IDLE))
+        return 1;
+    pp = &pageQueue[pageTail % PAGE_QUEUE_CAPACITY];
+    if (pp->needErase)
+        return (pp->compared < PAGESIZE) || pp->differs;
+    return pp->programmed < wholeBufferEnd(pp);
+}
+
+/*
+ * Start writing everything queued so far except
+ * a partial write buffer at the end of the newest page
+ */
+void
+linearFlashFlush(void)
+{
+    isFlushing = 1;
+}
+
+/*
+ * Wait for queued writes to complete
+ */
+void
+linearFlashDrain(void)
+{
+    int wasDraining = isDraining;
+
+    linearFlashFlush();
+    isDraining = 1;
+    while (pageHead != pageTail) {
+        linearFlashCheck();
+        checkForWork();
+    }
+    isDraining = wasDraining;
+}
+
+/*
+ * Wait for queued writes to complete and report, then
+ * clear, any errors since the previous call.
+ */
+int
+linearFlashSync(void)
+{
+    int errors;
+
+    linearFlashDrain();
+    errors = writeErrors;
+    writeErrors = 0;
+    return errors ? -1 : 0;
+}
+
+/*
+ * Synchronous write
+ */
+int
+linearFlashWrite(unsigned int address, const char *buf, unsigned int nBytes)
+{
+    int i;
+
+    if (nBytes == 0)
+        return 0;
+    while ((i = linearFlashQueueWrite(address, buf, nBytes)) == 0) {
+        linearFlashCheck();
+        checkForWork();
+    }
+    if ((linearFlashSync() < 0) || (i < 0))
+        return -1;
     return nBytes;
 }
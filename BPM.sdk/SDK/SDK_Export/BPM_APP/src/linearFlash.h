@@ -5,9 +5,19 @@
 #ifndef _LINEAR_FLASH_H_
 #define _LINEAR_FLASH_H_
 
+#define LINEAR_FLASH_PAGE_SIZE  (128*1024) /* Erase block size */
+
 int linearFlashInit(void);
 int linearFlashRead(unsigned int address, char *buf, unsigned int nBytes);
 int linearFlashWrite(unsigned int address, const char *buf, unsigned int nBytes);
+int linearFlashQueueWrite(unsigned int address, const char *buf,
+                                                        unsigned int nBytes);
+void linearFlashCheck(void);
+int linearFlashBusy(void);
+void linearFlashFlush(void);
+void linearFlashDrain(void);
+int linearFlashSync(void);
+void linearFlashStatistics(unsigned int *written, unsigned int *skipped);
 void linearFlashEraseAll(void);
 
 #endif
@@ -252,9 +252,11 @@ localOscSetPtTable(unsigned char *buf, int size)
 
 /*
  * Called when local oscillator table is to be downloaded from the TFTP server
+ * Return -1 if the table won't fit in the buffer.
  */
+#define LO_TABLE_FIELD_LIMIT 20 /* Longest possible "%9.6f," */
 static int
-localOscGetTable(unsigned char *buf, int isPt)
+localOscGetTable(unsigned char *buf, int capacity, int isPt)
 {
     int r, c, rowCount, colCount = isPt ? 4 : 2;
     int32_t *table = isPt ? ptTable : rfTable; 
@@ -263,6 +265,8 @@ localOscGetTable(unsigned char *buf, int isPt)
     rowCount = table[0];
     table += 2;
     for (r = 0 ; r < rowCount ; r++) {
+        if ((capacity - (cp - buf)) < (colCount * LO_TABLE_FIELD_LIMIT))
+            return -1;
         for (c = 0 ; c < colCount ; c++) {
             int i;
             char sep = (c == (colCount - 1)) ? '\n' : ',';
@@ -277,13 +281,13 @@ localOscGetTable(unsigned char *buf, int isPt)
 int
 localOscGetRfTable(unsigned char *buf, int size)
 {
-    return localOscGetTable(buf, 0);
+    return localOscGetTable(buf, size, 0);
 }
 
 int
 localOscGetPtTable(unsigned char *buf, int size)
 {
-    return localOscGetTable(buf, 1);
+    return localOscGetTable(buf, size, 1);
 }
 
 /*
@@ -0,0 +1,499 @@
+/*
+ * Streaming LZ4 frame decompression into flash
+ *
+ * Decodes the LZ4 frame format, as produced by the lz4 command line
+ * utility, so input may be supplied in arbitrary pieces as TFTP blocks
+ * arrive.  Output passes through a ring buffer that holds the 64 kB match
+ * history and is then queued for writing to flash.  Block checksums are
+ * skipped.  The content checksum, if present, is verified once all output
+ * has been queued.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "linearFlash.h"
+#include "lz4Stream.h"
+
+#define LZ4_MAGIC               0x184D2204
+#define FLG_VERSION_MASK        0xC0
+#define FLG_VERSION             0x40
+#define FLG_BLOCK_CHECKSUM      0x10
+#define FLG_CONTENT_SIZE        0x08
+#define FLG_CONTENT_CHECKSUM    0x04
+#define FLG_DICT_ID             0x01
+#define BD_BLOCK_MAX_SHIFT      4
+#define BD_BLOCK_MAX_MASK       0x7
+#define BLOCK_UNCOMPRESSED      0x80000000
+
+#define RING_SIZE       (128*1024) /* Power of 2 and larger than history */
+#define RING_MASK       (RING_SIZE-1)
+#define FLUSH_CHUNK     (4*1024)
+
+#define PRIME32_1   2654435761U
+#define PRIME32_2   2246822519U
+#define PRIME32_3   3266489917U
+#define PRIME32_4   668265263U
+#define PRIME32_5   374761393U
+
+static enum { S_MAGIC, S_DESCRIPTOR, S_BLOCK_SIZE, S_TOKEN, S_LITERAL_LENGTH,
+              S_LITERALS, S_OFFSET, S_MATCH_LENGTH, S_MATCH, S_RAW,
+              S_BLOCK_CHECKSUM, S_CONTENT_CHECKSUM, S_DONE, S_ERROR } state;
+
+static unsigned char ring[RING_SIZE];
+static uint32_t produced, flushed;
+static unsigned int flashAddress, outputCapacity;
+static unsigned char field[16];
+static int fieldLength, fieldNeeded;
+static int flags;
+static uint32_t blockMaximum, blockRemaining;
+static uint32_t literalLength, matchLength, matchOffset;
+static uint32_t contentChecksum;
+
+/*
+ * XXH32 with seed 0
+ */
+static struct xxh32 {
+    uint32_t      total;
+    uint32_t      v[4];
+    unsigned char mem[16];
+    unsigned int  memSize;
+} contentHash;
+
+static uint32_t
+rotl32(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t
+get32(const unsigned char *cp)
+{
+    return cp[0] | (cp[1] << 8) | ((uint32_t)cp[2] << 16) |
+                                  ((uint32_t)cp[3] << 24);
+}
+
+static uint32_t
+xxhRound(uint32_t acc, uint32_t input)
+{
+    acc += input * PRIME32_2;
+    acc = rotl32(acc, 13);
+    return acc * PRIME32_1;
+}
+
+static void
+xxhInit(struct xxh32 *h)
+{
+    h->total = 0;
+    h->v[0] = PRIME32_1 + PRIME32_2;
+    h->v[1] = PRIME32_2;
+    h->v[2] = 0;
+    h->v[3] = -PRIME32_1;
+    h->memSize = 0;
+}
+
+static void
+xxhUpdate(struct xxh32 *h, const unsigned char *cp, unsigned int n)
+{
+    int i;
+
+    h->total += n;
+    if ((h->memSize + n) < 16) {
+        memcpy(h->mem + h->memSize, cp, n);
+        h->memSize += n;
+        return;
+    }
+    if (h->memSize) {
+        unsigned int fill = 16 - h->memSize;
+        memcpy(h->mem + h->memSize, cp, fill);
+        for (i = 0 ; i < 4 ; i++)
+            h->v[i] = xxhRound(h->v[i], get32(h->mem + (4 * i)));
+        cp += fill;
+        n -= fill;
+        h->memSize = 0;
+    }
+    while (n >= 16) {
+        for (i = 0 ; i < 4 ; i++)
+            h->v[i] = xxhRound(h->v[i], get32(cp + (4 * i)));
+        cp += 16;
+        n -= 16;
+    }
+    if (n) {
+        memcpy(h->mem, cp, n);
+        h->memSize = n;
+    }
+}
+
+static uint32_t
+xxhDigest(const struct xxh32 *h)
+{
+    const unsigned char *cp = h->mem;
+    unsigned int n = h->memSize;
+    uint32_t acc;
+
+    if (h->total >= 16)
+        acc = rotl32(h->v[0], 1) + rotl32(h->v[1], 7) +
+              rotl32(h->v[2], 12) + rotl32(h->v[3], 18);
+    else
+        acc = h->v[2] + PRIME32_5;
+    acc += h->total;
+    while (n >= 4) {
+        acc += get32(cp) * PRIME32_3;
+        acc = rotl32(acc, 17) * PRIME32_4;
+        cp += 4;
+        n -= 4;
+    }
+    while (n--) {
+        acc += *cp++ * PRIME32_5;
+        acc = rotl32(acc, 11) * PRIME32_1;
+    }
+    acc ^= acc >> 15;
+    acc *= PRIME32_2;
+    acc ^= acc >> 13;
+    acc *= PRIME32_3;
+    acc ^= acc >> 16;
+    return acc;
+}
+
+static void
+fail(const char *msg)
+{
+    printf("LZ4: %s\n", msg);
+    state = S_ERROR;
+}
+
+static void
+expect(int newState, int n)
+{
+    state = newState;
+    fieldLength = 0;
+    fieldNeeded = n;
+}
+
+/*
+ * Queue as much output as the flash write queue will accept
+ */
+static int
+flush(void)
+{
+    while (flushed != produced) {
+        unsigned int idx = flushed & RING_MASK;
+        unsigned int n = produced - flushed;
+        int i;
+        if (n > (RING_SIZE - idx))
+            n = RING_SIZE - idx;
+        if (n > FLUSH_CHUNK)
+            n = FLUSH_CHUNK;
+        i = linearFlashQueueWrite(flashAddress + flushed, (char *)ring + idx, n);
+        if (i == 0)
+            break;
+        if (i < 0) {
+            fail("Flash write failed");
+            return -1;
+        }
+        xxhUpdate(&contentHash, ring + idx, n);
+        flushed += n;
+    }
+    return 0;
+}
+
+/*
+ * Number of bytes that may be output now
+ */
+static unsigned int
+outputRoom(void)
+{
+    unsigned int n;
+
+    if (produced >= outputCapacity) {
+        fail("Image too large");
+        return 0;
+    }
+    n = RING_SIZE - (produced - flushed);
+    if (n == 0) {
+        if (flush() < 0)
+            return 0;
+        n = RING_SIZE - (produced - flushed);
+    }
+    if (n > (outputCapacity - produced))
+        n = outputCapacity - produced;
+    return n;
+}
+
+static void
+endBlock(void)
+{
+    if (flags & FLG_BLOCK_CHECKSUM)
+        expect(S_BLOCK_CHECKSUM, 4);
+    else
+        expect(S_BLOCK_SIZE, 4);
+}
+
+/*
+ * Account for a byte of compressed block data
+ */
+static int
+blockByte(void)
+{
+    if (blockRemaining == 0) {
+        fail("Truncated block");
+        return 0;
+    }
+    blockRemaining--;
+    return 1;
+}
+
+static void
+descriptorByte(unsigned char c)
+{
+    field[fieldLength++] = c;
+    if (fieldLength == 2) {
+        int bd = (field[1] >> BD_BLOCK_MAX_SHIFT) & BD_BLOCK_MAX_MASK;
+        flags = field[0];
+        if ((flags & FLG_VERSION_MASK) != FLG_VERSION) {
+            fail("Unsupported version");
+            return;
+        }
+        if (flags & FLG_DICT_ID) {
+            fail("Dictionaries unsupported");
+            return;
+        }
+        if (bd < 4) {
+            fail("Bad block maximum size");
+            return;
+        }
+        blockMaximum = 1UL << (8 + (2 * bd));
+        fieldNeeded = 3 + ((flags & FLG_CONTENT_SIZE) ? 8 : 0);
+    }
+    else if (fieldLength == fieldNeeded) {
+        struct xxh32 h;
+        xxhInit(&h);
+        xxhUpdate(&h, field, fieldLength - 1);
+        if (((xxhDigest(&h) >> 8) & 0xFF) != field[fieldLength - 1]) {
+            fail("Header checksum mismatch");
+            return;
+        }
+        expect(S_BLOCK_SIZE, 4);
+    }
+}
+
+static void
+blockSize(uint32_t size)
+{
+    if (size == 0) {
+        if (flags & FLG_CONTENT_CHECKSUM)
+            expect(S_CONTENT_CHECKSUM, 4);
+        else
+            state = S_DONE;
+        return;
+    }
+    blockRemaining = size & ~BLOCK_UNCOMPRESSED;
+    if (blockRemaining > blockMaximum) {
+        fail("Block too large");
+        return;
+    }
+    state = (size & BLOCK_UNCOMPRESSED) ? S_RAW : S_TOKEN;
+}
+
+void
+lz4StreamInit(unsigned int address, unsigned int capacity)
+{
+    flashAddress = address;
+    outputCapacity = capacity;
+    produced = flushed = 0;
+    flags = 0;
+    xxhInit(&contentHash);
+    expect(S_MAGIC, 4);
+}
+
+int
+lz4StreamWrite(const unsigned char *buf, int nBytes)
+{
+    int i = 0;
+    unsigned int n = 0;
+    unsigned char c;
+
+    if ((state == S_ERROR) || (flush() < 0))
+        return -1;
+    for (;;) {
+        /*
+         * States that need no input
+         */
+        if ((state == S_LITERALS) && (literalLength == 0)) {
+            if (blockRemaining == 0)
+                endBlock();
+            else
+                expect(S_OFFSET, 2);
+            continue;
+        }
+        if ((state == S_RAW) && (blockRemaining == 0)) {
+            endBlock();
+            continue;
+        }
+        if ((state == S_LITERALS) || (state == S_MATCH) || (state == S_RAW)) {
+            n = outputRoom();
+            if (state == S_ERROR)
+                return -1;
+            if (n == 0)
+                break;
+        }
+        if (state == S_MATCH) {
+            if (n > matchLength)
+                n = matchLength;
+            matchLength -= n;
+            while (n--) {
+                ring[produced & RING_MASK] =
+                                    ring[(produced - matchOffset) & RING_MASK];
+                produced++;
+            }
+            if (matchLength == 0) {
+                if (blockRemaining == 0)
+                    endBlock();
+                else
+                    state = S_TOKEN;
+            }
+            continue;
+        }
+        if (i >= nBytes)
+            break;
+
+        /*
+         * States that consume input
+         */
+        switch (state) {
+        case S_MAGIC:
+            field[fieldLength++] = buf[i++];
+            if (fieldLength == fieldNeeded) {
+                if (get32(field) != LZ4_MAGIC)
+                    fail("Bad magic number");
+                else
+                    expect(S_DESCRIPTOR, 2);
+            }
+            break;
+
+        case S_DESCRIPTOR:
+            descriptorByte(buf[i++]);
+            break;
+
+        case S_BLOCK_SIZE:
+            field[fieldLength++] = buf[i++];
+            if (fieldLength == fieldNeeded)
+                blockSize(get32(field));
+            break;
+
+        case S_TOKEN:
+            c = buf[i++];
+            if (!blockByte())
+                break;
+            literalLength = c >> 4;
+            matchLength = c & 0xF;
+            state = (literalLength == 15) ? S_LITERAL_LENGTH : S_LITERALS;
+            break;
+
+        case S_LITERAL_LENGTH:
+            c = buf[i++];
+            if (!blockByte())
+                break;
+            literalLength += c;
+            if (c != 255)
+                state = S_LITERALS;
+            break;
+
+        case S_LITERALS:
+        case S_RAW:
+            if (n > (unsigned int)(nBytes - i))
+                n = nBytes - i;
+            if ((state == S_LITERALS) && (n > literalLength))
+                n = literalLength;
+            if ((state == S_RAW) && (n > blockRemaining))
+                n = blockRemaining;
+            if (n > blockRemaining) {
+                fail("Truncated block");
+                break;
+            }
+            blockRemaining -= n;
+            if (state == S_LITERALS)
+                literalLength -= n;
+            while (n--)
+                ring[produced++ & RING_MASK] = buf[i++];
+            break;
+
+        case S_OFFSET:
+            field[fieldLength++] = buf[i++];
+            if (!blockByte())
+                break;
+            if (fieldLength == fieldNeeded) {
+                matchOffset = field[0] | (field[1] << 8);
+                if ((matchOffset == 0) || (matchOffset > produced))
+                    fail("Bad match offset");
+                else if (matchLength == 15)
+                    state = S_MATCH_LENGTH;
+                else {
+                    matchLength += 4;
+                    state = S_MATCH;
+                }
+            }
+            break;
+
+        case S_MATCH_LENGTH:
+            c = buf[i++];
+            if (!blockByte())
+                break;
+            matchLength += c;
+            if (c != 255) {
+                matchLength += 4;
+                state = S_MATCH;
+            }
+            break;
+
+        case S_BLOCK_CHECKSUM:
+            field[fieldLength++] = buf[i++];
+            if (fieldLength == fieldNeeded)
+                expect(S_BLOCK_SIZE, 4);
+            break;
+
+        case S_CONTENT_CHECKSUM:
+            field[fieldLength++] = buf[i++];
+            if (fieldLength == fieldNeeded) {
+                contentChecksum = get32(field);
+                state = S_DONE;
+            }
+            break;
+
+        default:
+            fail("Data beyond end of frame");
+            break;
+        }
+        if (state == S_ERROR)
+            return -1;
+    }
+    if (flush() < 0)
+        return -1;
+    return i;
+}
+
+int
+lz4StreamFinish(void)
+{
+    if (state == S_ERROR)
+        return -1;
+    if (state != S_DONE) {
+        fail("Truncated frame");
+        return -1;
+    }
+    if (flush() < 0)
+        return -1;
+    if (flushed != produced)
+        return 0;
+    if ((flags & FLG_CONTENT_CHECKSUM)
+     && (xxhDigest(&contentHash) != contentChecksum)) {
+        fail("Content checksum mismatch");
+        return -1;
+    }
+    return 1;
+}
+
+unsigned int
+lz4StreamSize(void)
+{
+    return produced;
+}
@@ -0,0 +1,33 @@
+/*
+ * Streaming LZ4 frame decompression into flash
+ */
+
+#ifndef _LZ4_STREAM_H_
+#define _LZ4_STREAM_H_
+
+/*
+ * Start decompressing a frame to be written at the given flash address.
+ * Decompressed output is limited to capacity bytes.
+ */
+void lz4StreamInit(unsigned int address, unsigned int capacity);
+
+/*
+ * Returns the number of input bytes consumed, which is less than nBytes
+ * if the flash write queue is full, or -1 if the frame is malformed or
+ * the output would be too large.
+ */
+int lz4StreamWrite(const unsigned char *buf, int nBytes);
+
+/*
+ * Returns 1 once all output has been queued for writing and the
+ * frame is complete and its content checksum (if present) matches,
+ * 0 if output remains to be queued, or -1 on error.
+ */
+int lz4StreamFinish(void);
+
+/*
+ * Number of decompressed bytes
+ */
+unsigned int lz4StreamSize(void);
+
+#endif
@@ -78,8 +78,8 @@ main(void)
 
     /* And away we go */
     printf("\nBPM running.\n");
+    schedInit(&netif);
     for (;;) {
-        xemacif_input(&netif);
         checkForWork();
     }
 }
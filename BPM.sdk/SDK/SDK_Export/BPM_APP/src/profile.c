@@ -0,0 +1,134 @@
+/*
+ * Lightweight execution time profiling
+ * Times come from the system clock counter so they
+ * include any time spent in interrupt handlers.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "bpmProtocol.h"
+#include "profile.h"
+#include "util.h"
+
+#define BIN_COUNT       BPM_PROTOCOL_PROFILE_BIN_COUNT
+#define BIN_0_LOG2      7   /* Bin 0 holds times below 2^7 cycles */
+
+static struct profile {
+    uint32_t           count;
+    uint32_t           maxCycles;
+    unsigned long long totalCycles;
+    uint32_t           bins[BIN_COUNT];
+} profiles[PROFILE_COUNT];
+
+static const char *profileNames[PROFILE_COUNT - TASK_COUNT] = {
+    [PROFILE_SERVER_CALLBACK - TASK_COUNT]    = "Server RX",
+    [PROFILE_PUBLISHER_CALLBACK - TASK_COUNT] = "Publisher RX",
+    [PROFILE_TFTP_CALLBACK - TASK_COUNT]      = "TFTP RX",
+    [PROFILE_CONSOLE_CALLBACK - TASK_COUNT]   = "Console RX",
+    [PROFILE_WFR_HEADER - TASK_COUNT]         = "WFR header",
+    [PROFILE_WFR_ENVELOPE - TASK_COUNT]       = "WFR envelope",
+    [PROFILE_WFR_DATA - TASK_COUNT]           = "WFR data",
+    [PROFILE_WFR_STREAM - TASK_COUNT]         = "WFR stream",
+};
+
+static const char *
+profileName(int id)
+{
+    if ((id < 0) || (id >= PROFILE_COUNT))
+        return "";
+    if (id < TASK_COUNT)
+        return schedTaskName(id);
+    return profileNames[id - TASK_COUNT];
+}
+
+void
+profileRecord(int id, uint32_t cycles)
+{
+    struct profile *pp = &profiles[id];
+    uint32_t c = cycles >> BIN_0_LOG2;
+    int bin = 0;
+
+    while (c && (bin < (BIN_COUNT - 1))) {
+        c >>= 1;
+        bin++;
+    }
+    pp->bins[bin]++;
+    pp->count++;
+    pp->totalCycles += cycles;
+    if (cycles > pp->maxCycles)
+        pp->maxCycles = cycles;
+}
+
+void
+profileClear(void)
+{
+    memset(profiles, 0, sizeof profiles);
+}
+
+/*
+ * Show profile, times in microseconds
+ */
+void
+profileShow(int showBins)
+{
+    int id, i;
+    const int cyclesPerUs = XPAR_MICROBLAZE_FREQ / 1000000;
+
+    printf("        Point         Count  Total(ms)  Mean(us)  Max(us)\n");
+    for (id = 0 ; id < PROFILE_COUNT ; id++) {
+        struct profile *pp = &profiles[id];
+        printf("%13s ", profileName(id));
+        uintPrint(pp->count);
+        printf(" %10u %9u %8u\n",
+              (unsigned int)(pp->totalCycles / (cyclesPerUs * 1000)),
+              pp->count ? (unsigned int)((pp->totalCycles / pp->count) /
+                                                        cyclesPerUs) : 0,
+              (unsigned int)(pp->maxCycles / cyclesPerUs));
+        if (!showBins || (pp->count == 0))
+            continue;
+        printf("              ");
+        for (i = 0 ; i < BIN_COUNT ; i++)
+            printf(" %u", (unsigned int)pp->bins[i]);
+        printf("\n");
+    }
+}
+
+/*
+ * Handle IOC request
+ */
+void
+profileCommand(const struct bpmCommand *cmd, struct bpmReply *reply)
+{
+    int id = (cmd->value >> 8) & 0xFF;
+    int item = cmd->value & 0xFF;
+    const struct profile *pp;
+
+    if (cmd->code & BPM_PROTOCOL_WRITE_MASK)
+        profileClear();
+    if (item == BPM_PROTOCOL_PROFILE_ITEM_NAME) {
+        strncpy(reply->u.str, profileName(id), sizeof reply->u.str);
+        return;
+    }
+    reply->u.value = 0;
+    if (id >= PROFILE_COUNT)
+        return;
+    pp = &profiles[id];
+    switch (item) {
+    case BPM_PROTOCOL_PROFILE_ITEM_COUNT:
+        reply->u.value = pp->count;
+        break;
+    case BPM_PROTOCOL_PROFILE_ITEM_CYCLES_LO:
+        reply->u.value = pp->totalCycles;
+        break;
+    case BPM_PROTOCOL_PROFILE_ITEM_CYCLES_HI:
+        reply->u.value = pp->totalCycles >> 32;
+        break;
+    case BPM_PROTOCOL_PROFILE_ITEM_MAX_CYCLES:
+        reply->u.value = pp->maxCycles;
+        break;
+    default:
+        if ((item >= BPM_PROTOCOL_PROFILE_ITEM_BIN_0)
+         && (item < (BPM_PROTOCOL_PROFILE_ITEM_BIN_0 + BIN_COUNT)))
+            reply->u.value = pp->bins[item - BPM_PROTOCOL_PROFILE_ITEM_BIN_0];
+        break;
+    }
+}
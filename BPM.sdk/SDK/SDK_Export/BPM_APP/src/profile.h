@@ -0,0 +1,34 @@
+/*
+ * Lightweight execution time profiling
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdint.h>
+#include "bpmProtocol.h"
+#include "gpio.h"
+#include "util.h"
+
+/*
+ * Profile points
+ * The first TASK_COUNT points are the scheduler tasks.
+ */
+enum profileId { PROFILE_SERVER_CALLBACK = TASK_COUNT,
+                 PROFILE_PUBLISHER_CALLBACK,
+                 PROFILE_TFTP_CALLBACK,
+                 PROFILE_CONSOLE_CALLBACK,
+                 PROFILE_WFR_HEADER,
+                 PROFILE_WFR_ENVELOPE,
+                 PROFILE_WFR_DATA,
+                 PROFILE_WFR_STREAM,
+                 PROFILE_COUNT };
+
+#define profileEnd(id, then) profileRecord((id), sysTicksSinceBoot() - (then))
+
+void profileRecord(int id, uint32_t cycles);
+void profileClear(void);
+void profileShow(int showBins);
+void profileCommand(const struct bpmCommand *cmd, struct bpmReply *reply);
+
+#endif
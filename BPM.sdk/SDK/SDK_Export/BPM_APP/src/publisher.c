@@ -1,6 +1,7 @@
 /*
  * Publish monitor values
  */
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <lwip/udp.h>
@@ -14,6 +15,7 @@
 #include "cellComm.h"
 #include "evr.h"
 #include "gpio.h"
+#include "profile.h"
 #include "localOscillator.h"
 #include "server.h"
 #include "sfp.h"
@@ -22,14 +24,349 @@
 #include "waveformRecorder.h"
 
 static struct udp_pcb *pcb;
-static struct ip_addr  subscriberAddr;
-static int             subscriberPort;
 
 /*
- * Send values to subscriber
+ * Subscribers
+ * A subscriber that hasn't been heard from for a while is dropped,
+ * unless it is the only one.  A lone IOC thus never has to resubscribe
+ * after a long pause.
+ * Only the primary subscriber, the longest subscribed, may set the
+ * cell controller fast orbit feedback index.  Other subscribers, such
+ * as diagnostic clients, can't disturb it.
+ */
+#define SUBSCRIBER_TIMEOUT_SECONDS  30
+static struct subscriber {
+    struct ip_addr addr;
+    int            port;            /* 0 = slot free */
+    uint32_t       secondsAtLastHeard;
+    uint32_t       subscriptionNumber;
+} subscribers[PUBLISHER_SUBSCRIBER_CAPACITY];
+static int subscriberCount;
+static int primary = -1;
+static uint32_t subscriptionNumber;
+
+static void
+sendToSubscriber(int i, struct pbuf *p)
+{
+    udp_sendto(pcb, p, &subscribers[i].addr, subscribers[i].port);
+}
+
+/*
+ * Send to every subscriber
+ * udp_sendto mangles the pbuf so all but the last get a copy.
+ */
+static void
+sendToAll(struct pbuf *p)
+{
+    int i, last = -1;
+
+    for (i = 0 ; i < PUBLISHER_SUBSCRIBER_CAPACITY ; i++) {
+        if (subscribers[i].port == 0)
+            continue;
+        if (last >= 0) {
+            struct pbuf *q = pbuf_alloc(PBUF_TRANSPORT, p->tot_len, PBUF_RAM);
+            if (q) {
+                pbuf_copy_partial(p, q->payload, p->tot_len, 0);
+                sendToSubscriber(last, q);
+                pbuf_free(q);
+            }
+        }
+        last = i;
+    }
+    if (last >= 0)
+        sendToSubscriber(last, p);
+}
+
+/*
+ * Slow acquisition and system monitor packets go to the multicast
+ * group, if one has been configured, rather than to each subscriber.
+ */
+static void
+publish(struct pbuf *p)
+{
+    struct ip_addr group;
+    u8_t ttl;
+
+    group.addr = systemParameters.publisherMulticastGroup;
+    if (group.addr == 0) {
+        sendToAll(p);
+        return;
+    }
+    ttl = pcb->ttl;
+    pcb->ttl = systemParameters.publisherMulticastTTL;
+    udp_sendto(pcb, p, &group, BPM_PROTOCOL_PUBLISHER_UDP_PORT);
+    pcb->ttl = ttl;
+}
+
+/*
+ * Find the subscriber at the given address
+ */
+static int
+subscriberFind(struct ip_addr *addr, int port)
+{
+    int i;
+
+    for (i = 0 ; i < PUBLISHER_SUBSCRIBER_CAPACITY ; i++) {
+        if ((subscribers[i].port == port)
+         && (subscribers[i].addr.addr == addr->addr))
+            return i;
+    }
+    return -1;
+}
+
+static void
+subscriberHeard(int i)
+{
+    subscribers[i].secondsAtLastHeard = secondsSinceBoot();
+}
+
+static void
+subscriberDrop(int i)
+{
+    if (debugFlags & DEBUGFLAG_PUBLISHER) {
+        long addr = ntohl(subscribers[i].addr.addr);
+        printf("Drop subscriber %d (%d.%d.%d.%d:%d)\n", i,
+                                                (int)((addr >> 24) & 0xFF),
+                                                (int)((addr >> 16) & 0xFF),
+                                                (int)((addr >>  8) & 0xFF),
+                                                (int)((addr      ) & 0xFF),
+                                                subscribers[i].port);
+    }
+    subscribers[i].port = 0;
+    subscriberCount--;
+    wfrUnsubscribe(i);
+    if (i == primary) {
+        primary = -1;
+        for (i = 0 ; i < PUBLISHER_SUBSCRIBER_CAPACITY ; i++) {
+            if ((subscribers[i].port != 0)
+             && ((primary < 0)
+              || ((int32_t)(subscribers[i].subscriptionNumber -
+                            subscribers[primary].subscriptionNumber) < 0)))
+                primary = i;
+        }
+    }
+}
+
+/*
+ * Add a subscriber, or refresh an existing one.
+ * When the table is full the least recently heard subscriber is replaced.
+ */
+static int
+subscriberAdd(struct ip_addr *addr, int port)
+{
+    int i, oldest = -1;
+    uint32_t now = secondsSinceBoot();
+
+    if ((i = subscriberFind(addr, port)) < 0) {
+        for (i = 0 ; i < PUBLISHER_SUBSCRIBER_CAPACITY ; i++) {
+            if (subscribers[i].port == 0)
+                break;
+            if ((oldest < 0)
+             || ((now - subscribers[i].secondsAtLastHeard) >
+                 (now - subscribers[oldest].secondsAtLastHeard)))
+                oldest = i;
+        }
+        if (i == PUBLISHER_SUBSCRIBER_CAPACITY) {
+            i = oldest;
+            subscriberDrop(i);
+        }
+        subscribers[i].addr = *addr;
+        subscribers[i].port = port;
+        subscribers[i].subscriptionNumber = subscriptionNumber++;
+        subscriberCount++;
+        if (primary < 0)
+            primary = i;
+    }
+    subscriberHeard(i);
+    return i;
+}
+
+/*
+ * Drop subscribers that have gone quiet
+ */
+static void
+subscriberExpire(void)
+{
+    int i;
+    uint32_t now = secondsSinceBoot();
+
+    for (i = 0 ; i < PUBLISHER_SUBSCRIBER_CAPACITY ; i++) {
+        if ((subscribers[i].port != 0)
+         && (subscriberCount > 1)
+         && ((now - subscribers[i].secondsAtLastHeard) >
+                                                SUBSCRIBER_TIMEOUT_SECONDS))
+            subscriberDrop(i);
+    }
+}
+
+/*
+ * Read the slow acquisition snapshot
  */
 static void
-publishSlowAcquisition(unsigned int saSeconds, unsigned int saTicks)
+readSlowAcquisition(struct bpmSlowAcquisition *pk)
+{
+    int i;
+
+    pk->seconds = GPIO_READ(GPIO_IDX_SA_TIMESTAMP_SEC);
+    pk->ticks = GPIO_READ(GPIO_IDX_SA_TIMESTAMP_TICKS);
+    pk->xPos = GPIO_READ(GPIO_IDX_POSITION_CALC_SA_X);
+    pk->yPos = GPIO_READ(GPIO_IDX_POSITION_CALC_SA_Y);
+    pk->skew = GPIO_READ(GPIO_IDX_POSITION_CALC_SA_Q);
+    pk->buttonSum = GPIO_READ(GPIO_IDX_POSITION_CALC_SA_S);
+    pk->xRMSwide =  GPIO_READ(GPIO_IDX_RMS_X_WIDE);
+    pk->yRMSwide =  GPIO_READ(GPIO_IDX_RMS_Y_WIDE);
+    pk->xRMSnarrow =  GPIO_READ(GPIO_IDX_RMS_X_NARROW);
+    pk->yRMSnarrow =  GPIO_READ(GPIO_IDX_RMS_Y_NARROW);
+    for (i = 0 ; i < BPM_PROTOCOL_ADC_COUNT ; i++) {
+        pk->rfMag[i] = GPIO_READ(GPIO_IDX_PRELIM_RF_MAG_0+i);
+        pk->ptLoMag[i] = GPIO_READ(GPIO_IDX_PRELIM_PT_LO_MAG_0+i);
+        pk->ptHiMag[i] = GPIO_READ(GPIO_IDX_PRELIM_PT_HI_MAG_0+i);
+    }
+}
+
+/*
+ * Slow acquisition snapshots
+ * The FPGA latches the slow acquisition values together and advances
+ * the sequence number when it does so.  Read them again in the unlikely
+ * event that they were replaced while being read.
+ */
+struct saSnapshot {
+    uint32_t                  sequence;
+    uint32_t                  sysTicks;
+    struct bpmSlowAcquisition sa;
+};
+
+static void
+saCapture(struct saSnapshot *sp, uint32_t sequence)
+{
+    uint32_t check;
+
+    sp->sysTicks = sysTicksSinceBoot();
+    for (;;) {
+        readSlowAcquisition(&sp->sa);
+        check = GPIO_READ(GPIO_IDX_SA_SNAPSHOT_SEQUENCE);
+        if (check == sequence) break;
+        sequence = check;
+    }
+    sp->sequence = sequence;
+}
+
+/*
+ * Slow acquisition publication statistics
+ * Latency is the time from the SA marker to the packet being sent.
+ * Interval is the time between consecutive packets less the nominal
+ * SA marker interval.  Both are histogrammed in microseconds.
+ */
+#define HISTOGRAM_BIN_COUNT BPM_PROTOCOL_SA_HISTOGRAM_BIN_COUNT
+#define HISTOGRAM_BIN_WIDTH BPM_PROTOCOL_SA_HISTOGRAM_BIN_WIDTH
+static struct saHistogram {
+    const char *name;
+    int         firstBin;   /* Microseconds at lower edge of bin 0 */
+    uint32_t    count;
+    int         max;
+    uint32_t    bins[HISTOGRAM_BIN_COUNT];
+} saHistograms[] = {
+    [BPM_PROTOCOL_SA_HISTOGRAM_LATENCY]  = { "Latency",  0 },
+    [BPM_PROTOCOL_SA_HISTOGRAM_INTERVAL] = { "Interval",
+                                -(HISTOGRAM_BIN_COUNT/2)*HISTOGRAM_BIN_WIDTH },
+};
+#define SA_HISTOGRAM_COUNT (sizeof saHistograms / sizeof saHistograms[0])
+
+static void
+histogramRecord(struct saHistogram *hp, int us)
+{
+    int i = (us - hp->firstBin) / HISTOGRAM_BIN_WIDTH;
+
+    if (i < 0) i = 0;
+    else if (i >= HISTOGRAM_BIN_COUNT) i = HISTOGRAM_BIN_COUNT - 1;
+    hp->bins[i]++;
+    if ((hp->count == 0) || (us > hp->max)) hp->max = us;
+    hp->count++;
+}
+
+/*
+ * Return upper edge of bin holding the given percentile
+ */
+static int
+histogramPercentile(const struct saHistogram *hp, int percent)
+{
+    int i;
+    uint32_t sum = 0, target;
+
+    if (hp->count == 0)
+        return 0;
+    target = (((unsigned long long)hp->count * percent) + 99) / 100;
+    for (i = 0 ; i < (HISTOGRAM_BIN_COUNT - 1) ; i++) {
+        sum += hp->bins[i];
+        if (sum >= target) {
+            int edge = hp->firstBin + ((i + 1) * HISTOGRAM_BIN_WIDTH);
+            return edge < hp->max ? edge : hp->max;
+        }
+    }
+    return hp->max;
+}
+
+void
+publisherSaHistogramClear(void)
+{
+    int h;
+
+    for (h = 0 ; h < SA_HISTOGRAM_COUNT ; h++) {
+        saHistograms[h].count = 0;
+        saHistograms[h].max = 0;
+        memset(saHistograms[h].bins, 0, sizeof saHistograms[h].bins);
+    }
+}
+
+uint32_t
+publisherSaHistogramBin(unsigned int histogram, unsigned int bin)
+{
+    if ((histogram >= SA_HISTOGRAM_COUNT) || (bin >= HISTOGRAM_BIN_COUNT))
+        return 0;
+    return saHistograms[histogram].bins[bin];
+}
+
+/*
+ * Called just before a slow acquisition packet is sent
+ */
+static void
+saPublicationTiming(const struct saSnapshot *sp)
+{
+    static int havePrevious;
+    static uint32_t previousSequence, previousSysTicks;
+    uint32_t sysTicks = sysTicksSinceBoot();
+    uint32_t evrRate = GPIO_READ(GPIO_IDX_EVR_CLOCK_RATE);
+    struct evrTimestamp now;
+    long long evrTicks;
+
+    /* No timing system -- nothing meaningful to measure */
+    if (evrRate == 0)
+        return;
+    evrCurrentTime(&now);
+    evrTicks = ((long long)(int32_t)(now.secPastEpoch - sp->sa.seconds) *
+                                                                    evrRate) +
+                                        (long long)now.ticks - sp->sa.ticks;
+    if (evrTicks > evrRate) evrTicks = evrRate;
+    else if (evrTicks < -(long long)evrRate) evrTicks = -(long long)evrRate;
+    histogramRecord(&saHistograms[BPM_PROTOCOL_SA_HISTOGRAM_LATENCY],
+                                            (evrTicks * 1000000) / evrRate);
+    if (havePrevious && (sp->sequence == (previousSequence + 1))) {
+        int nominal = ((long long)systemParameters.evrPerSaMarker * 1000000) /
+                                                                    evrRate;
+        int interval = (sysTicks - previousSysTicks) /
+                                            (XPAR_MICROBLAZE_FREQ / 1000000);
+        histogramRecord(&saHistograms[BPM_PROTOCOL_SA_HISTOGRAM_INTERVAL],
+                                                        interval - nominal);
+    }
+    havePrevious = 1;
+    previousSysTicks = sysTicks;
+}
+
+/*
+ * Send values to subscribers
+ */
+static void
+publishSlowAcquisition(const struct saSnapshot *sp)
 {
     int i;
     struct pbuf *p;
@@ -42,40 +379,88 @@ publishSlowAcquisition(unsigned int saSeconds, unsigned int saTicks)
         return;
     }
     pk = (struct bpmSlowAcquisition *)p->payload;
+    memcpy(pk, &sp->sa, sizeof *pk);
     pk->packetNumber = packetNumber++;
-    pk->seconds = saSeconds;
-    pk->ticks = saTicks;
     pk->magic = BPM_PROTOCOL_MAGIC_SLOW_ACQUISITION;
-    pk->xPos = GPIO_READ(GPIO_IDX_POSITION_CALC_SA_X);
-    pk->yPos = GPIO_READ(GPIO_IDX_POSITION_CALC_SA_Y);
-    pk->skew = GPIO_READ(GPIO_IDX_POSITION_CALC_SA_Q);
-    pk->buttonSum = GPIO_READ(GPIO_IDX_POSITION_CALC_SA_S);
-    pk->xRMSwide =  GPIO_READ(GPIO_IDX_RMS_X_WIDE);
-    pk->yRMSwide =  GPIO_READ(GPIO_IDX_RMS_Y_WIDE);
-    pk->xRMSnarrow =  GPIO_READ(GPIO_IDX_RMS_X_NARROW);
-    pk->yRMSnarrow =  GPIO_READ(GPIO_IDX_RMS_Y_NARROW);
     pk->recorderStatus = wfrStatus();
     pk->syncStatus = GPIO_READ(GPIO_IDX_CLOCK_STATUS);
     pk->clipStatus = GPIO_READ(GPIO_IDX_SELFTRIGGER_CSR) >> 24;
     pk->sdSyncStatus = localOscGetSdSyncStatus();
     pk->cellCommStatus = cellCommStatus();
     pk->autotrimStatus = autotrimStatus();
-    for (i = 0 ; i < BPM_PROTOCOL_ADC_COUNT ; i++) {
-        pk->rfMag[i] = GPIO_READ(GPIO_IDX_PRELIM_RF_MAG_0+i);
-        pk->ptLoMag[i] = GPIO_READ(GPIO_IDX_PRELIM_PT_LO_MAG_0+i);
-        pk->ptHiMag[i] = GPIO_READ(GPIO_IDX_PRELIM_PT_HI_MAG_0+i);
+    for (i = 0 ; i < BPM_PROTOCOL_ADC_COUNT ; i++)
         pk->gainFactor[i] = GPIO_READ(GPIO_IDX_ADC_GAIN_FACTOR_0+i);
-    }
     r = GPIO_READ(GPIO_IDX_ADC_10_PEAK);
     pk->adcPeak[0] = r;
     pk->adcPeak[1] = r >> 16;
     r = GPIO_READ(GPIO_IDX_ADC_32_PEAK);
     pk->adcPeak[2] = r;
     pk->adcPeak[3] = r >> 16;
-    udp_sendto(pcb, p, &subscriberAddr, subscriberPort);
+    saPublicationTiming(sp);
+    publish(p);
     pbuf_free(p);
 }
 
+/*
+ * Handle a newly captured snapshot
+ */
+static void
+slowAcquisitionUpdate(const struct saSnapshot *sp, int isPublishing)
+{
+    static unsigned int previousSaSeconds, previousSaTicks;
+    static int sysTicksOld, evrTickDiffOld, sysTickDiffOld;
+    unsigned int saSeconds = sp->sa.seconds;
+    unsigned int saTicks = sp->sa.ticks;
+    int sysTickDiff = sp->sysTicks - sysTicksOld;
+    int evrTickDiff = (saTicks - previousSaTicks) +
+                                ((saSeconds-previousSaSeconds) * 124910000);
+
+    if (isPublishing
+     && (debugFlags & DEBUGFLAG_SA_TIMING_CHECK)
+     && ((evrTickDiff < 11241900) || (evrTickDiff > 13740100)
+      || (sysTickDiff < 9700000) || (sysTickDiff > 10200000))) {
+        printf("old:%d:%09d  new:%d:%09d "
+               "evrTickDiff:%d sysTickDiff:%d "
+               "evrTickDiffOld:%d sysTickDiffOld:%d\n",
+                                     previousSaSeconds, previousSaTicks,
+                                     saSeconds, saTicks,
+                                     evrTickDiff, sysTickDiff,
+                                     evrTickDiffOld, sysTickDiffOld);
+    }
+    sysTicksOld = sp->sysTicks;
+    evrTickDiffOld = evrTickDiff;
+    sysTickDiffOld = sysTickDiff;
+    previousSaSeconds = saSeconds;
+    previousSaTicks = saTicks;
+    if (isPublishing)
+        publishSlowAcquisition(sp);
+}
+
+/*
+ * Show SA publication statistics
+ */
+void
+publisherShowStatistics(int showBins)
+{
+    int h, i;
+
+    for (h = 0 ; h < SA_HISTOGRAM_COUNT ; h++) {
+        const struct saHistogram *hp = &saHistograms[h];
+        printf("SA %-8s (us) count:%u p50:%d p99:%d max:%d\n", hp->name,
+                                            (unsigned int)hp->count,
+                                            histogramPercentile(hp, 50),
+                                            histogramPercentile(hp, 99),
+                                            hp->max);
+        if (!showBins)
+            continue;
+        for (i = 0 ; i < HISTOGRAM_BIN_COUNT ; i++) {
+            if (hp->bins[i])
+                printf("%8d %u\n", hp->firstBin + (i * HISTOGRAM_BIN_WIDTH),
+                                                (unsigned int)hp->bins[i]);
+        }
+    }
+}
+
 static void
 publishSystemMonitor(void)
 {
@@ -127,71 +512,73 @@ publishSystemMonitor(void)
     }
     pk->crcFaultsCCW = cellCommCRCfaultsCCW();
     pk->crcFaultsCW = cellCommCRCfaultsCW();
-    udp_sendto(pcb, p, &subscriberAddr, subscriberPort);
+    pk->saLatencyP50 = histogramPercentile(
+                    &saHistograms[BPM_PROTOCOL_SA_HISTOGRAM_LATENCY], 50);
+    pk->saLatencyP99 = histogramPercentile(
+                    &saHistograms[BPM_PROTOCOL_SA_HISTOGRAM_LATENCY], 99);
+    pk->saLatencyMax = saHistograms[BPM_PROTOCOL_SA_HISTOGRAM_LATENCY].max;
+    pk->saIntervalP50 = histogramPercentile(
+                    &saHistograms[BPM_PROTOCOL_SA_HISTOGRAM_INTERVAL], 50);
+    pk->saIntervalP99 = histogramPercentile(
+                    &saHistograms[BPM_PROTOCOL_SA_HISTOGRAM_INTERVAL], 99);
+    pk->saIntervalMax = saHistograms[BPM_PROTOCOL_SA_HISTOGRAM_INTERVAL].max;
+    publish(p);
     pbuf_free(p);
 }
 
+static int
+isPublishing(void)
+{
+    return ((subscriberCount != 0)
+         || (systemParameters.publisherMulticastGroup != 0));
+}
+
+/*
+ * Publish slow acquisition values
+ * A new set of values has been latched when the
+ * snapshot sequence number changes.
+ */
+void
+publisherSlowAcquisitionCheck(void)
+{
+    static uint32_t previousSequence;
+    uint32_t saSequence = GPIO_READ(GPIO_IDX_SA_SNAPSHOT_SEQUENCE);
+
+    if (saSequence != previousSequence) {
+        struct saSnapshot snapshot;
+        saCapture(&snapshot, saSequence);
+        previousSequence = snapshot.sequence;
+        slowAcquisitionUpdate(&snapshot, isPublishing());
+    }
+}
+
 /*
- * Publish when appropriate
+ * Publish everything else when appropriate
  */
 void
 publisherCheck(void)
 {
     struct pbuf *p;
+    int subscriber;
     uint32_t now = sysTicksSinceBoot();
-    unsigned int saSeconds;
-    unsigned int saTicks;
-    static unsigned int previousSaSeconds, previousSaTicks, previousMonSysTicks;
-    
-    /*
-     * Wait for SA time stamp to stabilize
-     */
-    saTicks = GPIO_READ(GPIO_IDX_SA_TIMESTAMP_TICKS);
-    for (;;) {
-        unsigned int checkTicks;
-        saSeconds = GPIO_READ(GPIO_IDX_SA_TIMESTAMP_SEC);
-        checkTicks = GPIO_READ(GPIO_IDX_SA_TIMESTAMP_TICKS);
-        if (checkTicks == saTicks) break;
-        saTicks = checkTicks;
-    }
-    if (subscriberPort == 0) {
-        previousSaSeconds = saSeconds;
-        previousSaTicks = saTicks;
+    static unsigned int previousMonSysTicks;
+
+    subscriberExpire();
+    if (!isPublishing()) {
         previousMonSysTicks = now;
         cellCommStatus();
     }
     else {
-        if ((saTicks != previousSaTicks) || (saSeconds != previousSaSeconds)) {
-            int evrTickDiff = (saTicks - previousSaTicks) +
-                                ((saSeconds-previousSaSeconds) * 124910000);
-            unsigned int sysTicks = sysTicksSinceBoot();
-            static int sysTicksOld, evrTickDiffOld, sysTickDiffOld;
-            int sysTickDiff = sysTicks - sysTicksOld;
-            if ((debugFlags & DEBUGFLAG_SA_TIMING_CHECK)
-             && ((evrTickDiff < 11241900) || (evrTickDiff > 13740100)
-              || (sysTickDiff < 9700000) || (sysTickDiff > 10200000))) {
-                printf("old:%d:%09d  new:%d:%09d "
-                       "evrTickDiff:%d sysTickDiff:%d "
-                       "evrTickDiffOld:%d sysTickDiffOld:%d\n",
-                                             previousSaSeconds, previousSaTicks,
-                                             saSeconds, saTicks,
-                                             evrTickDiff, sysTickDiff,
-                                             evrTickDiffOld, sysTickDiffOld);
-            }
-            sysTicksOld = sysTicks;
-            evrTickDiffOld = evrTickDiff;
-            sysTickDiffOld = sysTickDiff;
-            previousSaSeconds = saSeconds;
-            previousSaTicks = saTicks;
-            publishSlowAcquisition(saSeconds, saTicks);
-        }
         if ((now - previousMonSysTicks) >
              (BPM_PROTOCOL_SECONDS_PER_MONITOR_UPDATE * XPAR_MICROBLAZE_FREQ)) {
             previousMonSysTicks = now;
             publishSystemMonitor();
         }
-        if ((p = wfrCheckForWork()) != NULL) {
-            udp_sendto(pcb, p, &subscriberAddr, subscriberPort);
+        while ((p = wfrCheckForWork(&subscriber)) != NULL) {
+            if (subscriber < 0)
+                sendToAll(p);
+            else if (subscribers[subscriber].port)
+                sendToSubscriber(subscriber, p);
             pbuf_free(p);
         }
     }
@@ -206,6 +593,8 @@ publisher_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
 {
     const char *cp = p->payload;
     static epicsInt16 fofbIndex = -1000;
+    int subscriber = subscriberFind(fromAddr, fromPort);
+    uint32_t then = sysTicksSinceBoot();
 
     /*
      * Must copy paylaod rather than just using payload area
@@ -223,27 +612,48 @@ publisher_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
                                                 (int)((addr      ) & 0xFF),
                                                 fromPort);
     }
-    if (p->len == sizeof fofbIndex) {
-        epicsInt16 newIndex;
-        memcpy(&newIndex, p->payload, sizeof newIndex);
-        if (newIndex != fofbIndex) {
-            fofbIndex = newIndex;
+    if ((p->len == sizeof fofbIndex)
+     || (p->len == offsetof(struct bpmSubscription, options))
+     || (p->len == sizeof(struct bpmSubscription))) {
+        struct bpmSubscription subscription;
+        subscription.waveformPayloadCapacity = 0;
+        subscription.options = 0;
+        memcpy(&subscription, p->payload, p->len);
+        subscriber = subscriberAdd(fromAddr, fromPort);
+        if ((subscriber == primary)
+         && (subscription.fofbIndex != fofbIndex)) {
+            fofbIndex = subscription.fofbIndex;
             cellCommSetFOFB(fofbIndex);
         }
-        subscriberAddr = *fromAddr;
-        subscriberPort = fromPort;
+        wfrSetSubscription(subscriber, subscription.waveformPayloadCapacity,
+                                       subscription.options);
     }
-    else if (subscriberPort && (p->len == sizeof(struct bpmWaveformAck))) {
+    else if ((subscriber >= 0)
+          && (p->len == sizeof(struct bpmWaveformAck))) {
         struct bpmWaveformAck bpmAck;
         struct pbuf *txPacket;
+        subscriberHeard(subscriber);
         memcpy(&bpmAck, p->payload, sizeof bpmAck);
-        txPacket = wfrAckPacket(&bpmAck);
+        txPacket = wfrAckPacket(subscriber, &bpmAck);
+        if (txPacket) {
+            sendToSubscriber(subscriber, txPacket);
+            pbuf_free(txPacket);
+        }
+    }
+    else if ((subscriber >= 0)
+          && (p->len == sizeof(struct bpmWaveformWindowAck))) {
+        static struct bpmWaveformWindowAck bpmWindowAck;
+        struct pbuf *txPacket;
+        subscriberHeard(subscriber);
+        memcpy(&bpmWindowAck, p->payload, sizeof bpmWindowAck);
+        txPacket = wfrWindowAckPacket(subscriber, &bpmWindowAck);
         if (txPacket) {
-            udp_sendto(pcb, txPacket, &subscriberAddr, subscriberPort);
+            sendToSubscriber(subscriber, txPacket);
             pbuf_free(txPacket);
         }
     }
     pbuf_free(p);
+    profileEnd(PROFILE_PUBLISHER_CALLBACK, then);
 }
 
 /*
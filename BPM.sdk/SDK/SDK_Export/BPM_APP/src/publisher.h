@@ -5,7 +5,15 @@
 #ifndef _PUBLISHER_H_
 #define _PUBLISHER_H_
 
+#include <stdint.h>
+
+#define PUBLISHER_SUBSCRIBER_CAPACITY   8
+
 void publisherInit(void);
 void publisherCheck(void);
+void publisherSlowAcquisitionCheck(void);
+void publisherShowStatistics(int showBins);
+void publisherSaHistogramClear(void);
+uint32_t publisherSaHistogramBin(unsigned int histogram, unsigned int bin);
 
 #endif
@@ -1,6 +1,7 @@
 /*
  * Accept and act upon commands from the IOC
  */
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <lwip/udp.h>
@@ -12,6 +13,8 @@
 #include "evr.h"
 #include "gpio.h"
 #include "localOscillator.h"
+#include "profile.h"
+#include "publisher.h"
 #include "server.h"
 #include "sfp.h"
 #include "util.h"
@@ -205,6 +208,15 @@ io_mtSumShift(const struct bpmCommand *cmd, struct bpmReply *reply)
     reply->u.value = sdAccumulateGetMtSumShift();
 }
 
+static void
+io_saHistogram(const struct bpmCommand *cmd, struct bpmReply *reply)
+{
+    if (cmd->code & BPM_PROTOCOL_WRITE_MASK)
+        publisherSaHistogramClear();
+    reply->u.value = publisherSaHistogramBin((cmd->value >> 8) & 0xFF,
+                                              cmd->value & 0xFF);
+}
+
 static void
 cv_command(const struct bpmCommand *cmd, struct bpmReply *reply)
 {
@@ -265,6 +277,11 @@ processCommand(const struct bpmCommand *cmd, struct bpmReply *reply)
         case BPM_PROTOCOL_COMMAND_IO_LATCH_CLEAR:io_latchClear(cmd, reply);break;
         case BPM_PROTOCOL_COMMAND_IO_TBT_SUM_SHIFT:io_tbtSumShift(cmd, reply);break;
         case BPM_PROTOCOL_COMMAND_IO_MT_SUM_SHIFT:io_mtSumShift(cmd, reply);break;
+        case BPM_PROTOCOL_COMMAND_IO_SA_HISTOGRAM:io_saHistogram(cmd, reply);break;
+        case BPM_PROTOCOL_COMMAND_IO_PROFILE:   profileCommand(cmd, reply);break;
+        case BPM_PROTOCOL_COMMAND_IO_SETTINGS:
+                             reply->u.value = BPM_PROTOCOL_SETTINGS_VERSION;
+                             break;
         }
         break;
 
@@ -288,6 +305,101 @@ processCommand(const struct bpmCommand *cmd, struct bpmReply *reply)
     }
 }
 
+/*
+ * Read back a setting
+ */
+static epicsUInt32
+readSetting(int code)
+{
+    struct bpmCommand cmd;
+    struct bpmReply reply;
+
+    cmd.magic = BPM_PROTOCOL_MAGIC_COMMAND;
+    cmd.commandNumber = 0;
+    cmd.code = code;
+    cmd.pad = 0;
+    cmd.value = 0;
+    reply.u.value = 0;
+    processCommand(&cmd, &reply);
+    return reply.u.value;
+}
+
+/*
+ * Gather all settings by reading them back exactly as the IOC would
+ */
+static void
+settingsSnapshot(struct bpmSettingsSnapshot *sp, epicsUInt32 commandNumber)
+{
+    int i, r;
+    static const int ioCodes[] = {
+        BPM_PROTOCOL_COMMAND_IO_DEBUG,
+        BPM_PROTOCOL_COMMAND_IO_ATTEN,
+        BPM_PROTOCOL_COMMAND_IO_ADC_GAIN,
+        BPM_PROTOCOL_COMMAND_IO_LOB_LIMIT,
+        BPM_PROTOCOL_COMMAND_IO_AT_ENABLE,
+        BPM_PROTOCOL_COMMAND_IO_AT_THRESH,
+        BPM_PROTOCOL_COMMAND_IO_SELFTRIG_LEV,
+        BPM_PROTOCOL_COMMAND_IO_BTN_DSP_ALG,
+        BPM_PROTOCOL_COMMAND_IO_AT_FILTER,
+        BPM_PROTOCOL_COMMAND_IO_TBT_SUM_SHIFT,
+        BPM_PROTOCOL_COMMAND_IO_MT_SUM_SHIFT };
+
+    memset(sp, 0, sizeof *sp);
+    sp->magic = BPM_PROTOCOL_MAGIC_SETTINGS_SNAPSHOT;
+    sp->commandNumber = commandNumber;
+    sp->version = BPM_PROTOCOL_SETTINGS_VERSION;
+    for (i = 0 ; i < (sizeof ioCodes / sizeof ioCodes[0]) ; i++)
+        sp->io[ioCodes[i]] = readSetting(BPM_PROTOCOL_GROUP_IOPOINT |
+                                                                ioCodes[i]);
+    for (i = 0 ; i < BPM_PROTOCOL_ADC_COUNT ; i++)
+        sp->gain[i] = readSetting(BPM_PROTOCOL_GROUP_PER_CHANNEL_VALUE |
+                                  BPM_PROTOCOL_COMMAND_CHANVAL_GAIN | i);
+    for (r = 0 ; r < BPM_PROTOCOL_RECORDER_COUNT ; r++) {
+        for (i = 0 ; i < BPM_PROTOCOL_SETTINGS_RECORDER_CAPACITY ; i++) {
+            int code = i << 4;
+            if ((code == BPM_PROTOCOL_COMMAND_WF_BYTES_SENT)
+             || (code == BPM_PROTOCOL_COMMAND_WF_SOFT_TRIGGER))
+                continue;
+            sp->recorder[r][i] = readSetting(BPM_PROTOCOL_GROUP_RECORDER |
+                                                                    code | r);
+        }
+    }
+    for (i = 0 ; i < BPM_PROTOCOL_SETTINGS_TRIGGER_CAPACITY ; i++)
+        sp->triggerDelay[i] = readSetting(BPM_PROTOCOL_GROUP_TRIGGER_DELAY | i);
+    for (i = 0 ; i < BPM_PROTOCOL_SETTINGS_EVENT_CAPACITY ; i++)
+        sp->eventTrigger[i] = readSetting(BPM_PROTOCOL_GROUP_EVENT_TRIGGERS | i);
+}
+
+/*
+ * Process each command in a batch
+ */
+static void
+processBatch(const struct bpmBatchCommand *batch, struct bpmBatchReply *batchReply)
+{
+    int i;
+    struct bpmCommand cmd;
+    struct bpmReply reply;
+
+    batchReply->magic = BPM_PROTOCOL_MAGIC_BATCH_REPLY;
+    batchReply->commandNumber = batch->commandNumber;
+    batchReply->count = batch->count;
+    batchReply->pad = 0;
+    cmd.magic = BPM_PROTOCOL_MAGIC_COMMAND;
+    cmd.commandNumber = batch->commandNumber;
+    cmd.pad = 0;
+    for (i = 0 ; i < batch->count ; i++) {
+        cmd.code = batch->items[i].code;
+        cmd.value = batch->items[i].value;
+        if (debugFlags & DEBUGFLAG_SERVER) {
+            printf("    Item %-3d code:0x%x value:%d\n", i, (int)cmd.code,
+                                                         (int)cmd.value);
+        }
+        reply.u.value = 0;
+        processCommand(&cmd, &reply);
+        batchReply->values[i] = reply.u.value;
+    }
+}
+
 /*
  * Send reply to client
  */
@@ -317,6 +429,10 @@ server_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
     struct bpmCommand command;
     static struct bpmCommand lastCommand;
     static struct bpmReply reply;
+    static struct bpmBatchCommand batch;
+    static struct bpmBatchReply batchReply;
+    static struct bpmSettingsSnapshot snapshot;
+    uint32_t then = sysTicksSinceBoot();
 
     if (debugFlags & DEBUGFLAG_SERVER) {
         printf("server_callback: %d from %d.%d.%d.%d:%d\n",
@@ -338,16 +454,42 @@ server_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
         if (((command.magic == BPM_PROTOCOL_MAGIC_COMMAND)
           && (p->len == sizeof command))
          || ((command.magic == BPM_PROTOCOL_MAGIC_FILTER_UPDATE)
-          && (p->len == sizeof(struct bpmFilterCoefficients)))) {
+          && (p->len == sizeof(struct bpmFilterCoefficients)))
+         || ((command.magic == BPM_PROTOCOL_MAGIC_BATCH_COMMAND)
+          && (command.code > 0)
+          && (command.code <= BPM_PROTOCOL_BATCH_CAPACITY)
+          && (p->len == (offsetof(struct bpmBatchCommand, items) +
+                            (command.code * sizeof(struct bpmBatchItem)))))) {
+            int isBatch = (command.magic == BPM_PROTOCOL_MAGIC_BATCH_COMMAND);
+            int batchReplySize = offsetof(struct bpmBatchReply, values) +
+                                (command.code * sizeof batchReply.values[0]);
             if (debugFlags & DEBUGFLAG_SERVER) {
                 printf("Command number %-6d code:0x%x value:%d\n",
                                             (unsigned int)command.commandNumber,
                                             (int)command.code,
                                             (int)command.value);
             }
-            if ((command.commandNumber == lastCommand.commandNumber)
-             && (command.code == lastCommand.code)) {
-                sendReply(&reply, sizeof reply, fromAddr, fromPort);
+            if ((command.magic == BPM_PROTOCOL_MAGIC_COMMAND)
+             && (command.code == (BPM_PROTOCOL_GROUP_IOPOINT |
+                                  BPM_PROTOCOL_COMMAND_IO_SETTINGS))) {
+                /* Read-only so a duplicate simply gets a fresh snapshot */
+                lastCommand = command;
+                settingsSnapshot(&snapshot, command.commandNumber);
+                sendReply(&snapshot, sizeof snapshot, fromAddr, fromPort);
+            }
+            else if ((command.commandNumber == lastCommand.commandNumber)
+             && (command.code == lastCommand.code)
+             && (command.magic == lastCommand.magic)) {
+                if (isBatch)
+                    sendReply(&batchReply, batchReplySize, fromAddr, fromPort);
+                else
+                    sendReply(&reply, sizeof reply, fromAddr, fromPort);
+            }
+            else if (isBatch) {
+                lastCommand = command;
+                memcpy(&batch, p->payload, p->len);
+                processBatch(&batch, &batchReply);
+                sendReply(&batchReply, batchReplySize, fromAddr, fromPort);
             }
             else {
                 lastCommand = command;
@@ -366,6 +508,7 @@ server_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
         }
     }
     pbuf_free(p);
+    profileEnd(PROFILE_SERVER_CALLBACK, then);
 }
 
 void serverInit(void)
@@ -1,6 +1,7 @@
 /*
  * Global settings
  */
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -13,21 +14,49 @@
 
 struct systemParameters systemParameters;
 
+#define EXTENSION_VERSION   1
+
+/*
+ * Sum of the words between two offsets
+ */
 static int
-checksum(void)
+checksumRange(int begin, int end)
 {
     int i, sum = 0xCAFEF00D;
-    const int *ip = (int *)&systemParameters;
+    const int *ip = (int *)((char *)&systemParameters + begin);
 
-    for (i = 0 ; i < ((sizeof systemParameters -
-                    sizeof systemParameters.checksum) / sizeof(*ip)) ; i++)
+    for (i = 0 ; i < ((end - begin) / sizeof(*ip)) ; i++)
         sum += *ip++;
     return sum;
 }
 
+static int
+checksum(void)
+{
+    return checksumRange(0, offsetof(struct systemParameters, checksum));
+}
+
+static int
+extensionChecksum(void)
+{
+    return checksumRange(offsetof(struct systemParameters, extensionVersion),
+                         offsetof(struct systemParameters, extensionChecksum));
+}
+
 void systemParametersUpdateChecksum(void)
 {
     systemParameters.checksum = checksum();
+    systemParameters.extensionVersion = EXTENSION_VERSION;
+    systemParameters.extensionChecksum = extensionChecksum();
+}
+
+/*
+ * Multicast group must be 0 (unused) or in 224.0.0.0/4
+ */
+static int
+isBadMulticastGroup(unsigned long group)
+{
+    return (group != 0) && ((ntohl(group) >> 28) != 0xE);
 }
 
 /*
@@ -67,6 +96,8 @@ systemParametersReadback(const unsigned char *buf)
         systemParameters.qCalibration = 16.0;
         systemParameters.buttonRotation = 45;
         memset(systemParameters.afeTrim, 0, sizeof systemParameters.afeTrim);
+        systemParameters.publisherMulticastGroup = 0;
+        systemParameters.publisherMulticastTTL = 1;
 
         /* Replace network parameters if they look questionable */
         if (((mask != 0xFFFFFF00) && (mask != 0xFFFFFC00))
@@ -94,6 +125,19 @@ systemParametersReadback(const unsigned char *buf)
         }
         systemParametersUpdateChecksum();
     }
+
+    /*
+     * Tables written by earlier firmware have no valid extension
+     */
+    if ((systemParameters.extensionVersion != EXTENSION_VERSION)
+     || (extensionChecksum() != systemParameters.extensionChecksum)
+     || isBadMulticastGroup(systemParameters.publisherMulticastGroup)
+     || (systemParameters.publisherMulticastTTL < 1)
+     || (systemParameters.publisherMulticastTTL > 255)) {
+        systemParameters.publisherMulticastGroup = 0;
+        systemParameters.publisherMulticastTTL = 1;
+        systemParametersUpdateChecksum();
+    }
 }
 
 /*
@@ -273,12 +317,15 @@ formatInt4(void *val)
 
 /*
  * Conversion table
+ * Optional entries may be absent from the end of tables
+ * written before they were added.
  */
 static struct conv {
     const char *name;
     void       *addr;
     char     *(*format)(void *val);
     int       (*parse)(const char *str, void *val);
+    int         isOptional;
 } conv[] = {
   {"Ethernet Address", &systemParameters.ethernetAddress,formatMAC,  parseMAC},
   {"IP Address",       &systemParameters.ipv4.address,    formatIP,   parseIP},
@@ -306,6 +353,10 @@ static struct conv {
                        &systemParameters.buttonRotation, formatInt,  parseInt},
   {"AFE attenuator trims (dB)",
                        &systemParameters.afeTrim[0],   formatAtrim,parseAtrim},
+  {"Publisher multicast group",
+            &systemParameters.publisherMulticastGroup, formatIP, parseIP, 1},
+  {"Publisher multicast TTL",
+            &systemParameters.publisherMulticastTTL, formatInt, parseInt, 1},
 };
 
 /*
@@ -332,6 +383,8 @@ parseTable(unsigned char *buf, int size, char **err)
 
     for (i = 0 ; i < (sizeof conv / sizeof conv[0]) ; i++) {
         l = strlen(conv[i].name);
+        if (conv[i].isOptional && ((cp - base) >= size))
+            break;
         if (((cp - base) + l + 2) >= size) {
             *err = "Unexpected EOF";
             return -line;
@@ -378,6 +431,16 @@ systemParametersSetTable(unsigned char *buf, int size)
         sprintf((char *)buf, "Bad button rotation (must be 0 or 45)");
         return -1;
     }
+    if (isBadMulticastGroup(systemParameters.publisherMulticastGroup)) {
+        sprintf((char *)buf, "Bad publisher multicast group "
+                             "(must be 0.0.0.0 or 224.0.0.0 to 239.255.255.255)");
+        return -1;
+    }
+    if ((systemParameters.publisherMulticastTTL < 1)
+     || (systemParameters.publisherMulticastTTL > 255)) {
+        sprintf((char *)buf, "Bad publisher multicast TTL (must be 1 to 255)");
+        return -1;
+    }
     systemParametersUpdateChecksum();
     memcpy(buf, &systemParameters, sizeof systemParameters);
     return sizeof systemParameters;
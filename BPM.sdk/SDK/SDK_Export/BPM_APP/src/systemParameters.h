@@ -28,6 +28,16 @@ extern struct systemParameters {
     int            buttonRotation;
     int            afeTrim[4]; /* Per-channel trims in units of 0.25 dB */
     unsigned long  checksum;
+
+    /*
+     * Beyond the checksum so tables written by earlier firmware
+     * remain valid.  Covered by a separate checksum along with a
+     * version number that changes whenever entries are added here.
+     */
+    unsigned long  extensionVersion;
+    unsigned long  publisherMulticastGroup; /* 0 for unicast to subscribers */
+    int            publisherMulticastTTL;
+    unsigned long  extensionChecksum;
 } systemParameters;
 
 int systemParametersGetTable(unsigned char *buf, int capacity);
@@ -5,8 +5,10 @@
  *      AFE attenuator compensation table
  *      System settings (Ethenet address, IP address, etc.)
  */
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <lwip/udp.h>
 #include <xparameters.h>
@@ -14,7 +16,10 @@
 #include "gpio.h"
 #include "linearFlash.h"
 #include "localOscillator.h"
+#include "lz4Stream.h"
+#include "profile.h"
 #include "systemParameters.h"
+#include "tftp.h"
 #include "util.h"
 
 #define TFTP_PORT 69
@@ -24,10 +29,14 @@
 #define TFTP_OPCODE_DATA  3
 #define TFTP_OPCODE_ACK   4
 #define TFTP_OPCODE_ERROR 5
+#define TFTP_OPCODE_OACK  6
 
 #define TFTP_ERROR_ACCESS_VIOLATION 2
-#define TFTP_PAYLOAD_CAPACITY   512
-#define TFTP_PACKET_CAPACITY    ((2 * sizeof (u16_t)) + TFTP_PAYLOAD_CAPACITY)
+#define TFTP_PAYLOAD_CAPACITY   512     /* Without blksize option */
+#define TFTP_MAX_PAYLOAD_CAPACITY 1428  /* Unfragmented on Ethernet */
+#define TFTP_MIN_PAYLOAD_CAPACITY 8
+#define TFTP_WINDOW_CAPACITY    16      /* RFC 7440 windowsize limit */
+#define TFTP_WINDOW_BYTE_LIMIT  (16*1024) /* Data lwIP may have to buffer */
 
 #define TRANSFER_TIMEOUT_SECONDS 30 /* Assume client is gone after this long */
 #define ticks2microsec(t) ((unsigned int)(t)/(XPAR_MICROBLAZE_FREQ/1000000))
@@ -78,11 +87,83 @@ static struct fileInfo fileTable[] = {
 #define FILE_TABLE_PARAMETER_TABLE_INDEX 2
 
 /*
- * UDP transfer buffer
- * Allow space for extra terminating '\0'.
+ * Journaled tables
+ * The region of each table (files with a postReceive routine) holds a
+ * sequence of records.  A change appends a record so a page is erased
+ * only when appending reaches it, rather than on every change.  Records
+ * start on a flash write buffer boundary so no location is programmed
+ * twice.  The newest intact record is the one with the highest sequence
+ * number.  A region with no intact records holds the table itself, as
+ * written by earlier software.
  */
-static unsigned char ioBuf[MB(1)+1];
-static unsigned char *ioPtr = ioBuf;
+#define JOURNAL_MAGIC       0x4A524E4C
+#define JOURNAL_ERASED      0xFFFFFFFF
+#define JOURNAL_ALIGNMENT   1024
+#define JOURNAL_CHUNK       4096
+struct journalHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t length;
+    uint32_t check;
+};
+static struct journal {
+    const unsigned char *newest;    /* Newest record contents, or NULL */
+    uint32_t             sequence;
+    int                  next;      /* Offset at which to append */
+} journals[FILE_TABLE_SIZE];
+
+/*
+ * Transfers in progress
+ * Any number of table reads may proceed at the same time, but transfers
+ * that read or write flash are serialized against one writing flash.
+ * Each session has a buffer large enough for the text of most tables.
+ * A table upload, or a read of a table too large for the session buffer,
+ * uses a single shared buffer with space for an extra terminating '\0'.
+ */
+#define TFTP_SESSION_CAPACITY 4
+#define TFTP_TABLE_BUFFER_SIZE kB(32)
+static struct session {
+    int            isActive;
+    struct ip_addr addr;
+    u16_t          port;
+    int            fileIndex;
+    int            isRead;
+    int            lastSeconds;
+    int            blockSize;
+    int            windowSize;
+    int            windowCount;     /* Blocks received since last ACK */
+    int            ioOffset;
+    int            fileSize;
+    unsigned int   sendBase;        /* Index of first unacknowledged block */
+    u16_t          lastBlock;
+    int            ackedOutOfOrder;
+    unsigned char *ioPtr;
+    unsigned char  ioBuf[TFTP_TABLE_BUFFER_SIZE];
+} sessions[TFTP_SESSION_CAPACITY];
+static unsigned char sharedBuf[MB(1)+1];
+static struct session *sharedBufOwner;
+
+/*
+ * The session writing flash
+ */
+static struct session *writer;
+static int startSeconds;
+static int isCompressed;    /* Image is an LZ4 frame */
+
+/*
+ * Data block awaiting room in the flash write queue.
+ * It is acknowledged once it has been queued or, for the final
+ * block of a file, once everything has been written to flash.
+ */
+static struct {
+    int            isPending;
+    int            isLast;
+    int            wasStalled;
+    u16_t          block;
+    int            offset;
+    int            nBytes;
+    unsigned char  data[TFTP_MAX_PAYLOAD_CAPACITY];
+} pending;
 
 /*
  * Get the size of a file
@@ -92,6 +173,7 @@ getSize(int fileIndex)
 {
     int *ip = (int *)(XPAR_LINEAR_FLASH_S_AXI_MEM0_BASEADDR + SIZE_TABLE_OFFSET);
 
+    linearFlashDrain();
     if (fileIndex == (FILE_TABLE_SIZE-1))
         return fileTable[fileIndex].maxSize;
     ip += 2 * fileIndex;
@@ -113,8 +195,8 @@ static void
 setSize(int fileIndex, int size)
 {
     int *ip = (int *)(XPAR_LINEAR_FLASH_S_AXI_MEM0_BASEADDR + SIZE_TABLE_OFFSET);
-    int *sv = (int *)ioBuf;
-    int io = 2 * FILE_TABLE_SIZE * sizeof(*ip);
+    int sv[2 * FILE_TABLE_SIZE];
+    int io = sizeof sv;
 
     memcpy(sv, ip, io);
     sv[(2 * fileIndex)] = size;
@@ -122,6 +204,154 @@ setSize(int fileIndex, int size)
     linearFlashWrite(SIZE_TABLE_OFFSET, (char *)sv, io);
 }
 
+static const unsigned char *
+regionBase(int fileIndex)
+{
+    return (const unsigned char *)(XPAR_LINEAR_FLASH_S_AXI_MEM0_BASEADDR +
+                                   fileTable[fileIndex].baseAddress);
+}
+
+static int
+journalSpan(int length)
+{
+    int n = sizeof(struct journalHeader) + length;
+    return (n + JOURNAL_ALIGNMENT - 1) & ~(JOURNAL_ALIGNMENT - 1);
+}
+
+static uint32_t
+journalChecksum(const struct journalHeader *hp, const unsigned char *cp)
+{
+    const unsigned char *hcp = (const unsigned char *)hp;
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0 ; i < offsetof(struct journalHeader, check) ; i++)
+        sum = ((sum << 1) | (sum >> 31)) + hcp[i];
+    for (i = 0 ; i < hp->length ; i++)
+        sum = ((sum << 1) | (sum >> 31)) + cp[i];
+    return sum;
+}
+
+/*
+ * Find the newest intact record of a table.
+ * Skip over torn or erased write buffers.
+ */
+static void
+journalScan(int fileIndex)
+{
+    struct journal *jp = &journals[fileIndex];
+    const unsigned char *base = regionBase(fileIndex);
+    int size = fileTable[fileIndex].maxSize;
+    int o = 0;
+    struct journalHeader h;
+
+    jp->newest = NULL;
+    jp->sequence = 0;
+    jp->next = 0;
+    while (o <= (int)(size - sizeof h)) {
+        memcpy(&h, base + o, sizeof h);
+        if ((h.magic == JOURNAL_MAGIC)
+         && (h.length <= (size - o - sizeof h))
+         && (journalChecksum(&h, base + o + sizeof h) == h.check)) {
+            if ((jp->newest == NULL) || ((int32_t)(h.sequence - jp->sequence) > 0)) {
+                jp->newest = base + o + sizeof h;
+                jp->sequence = h.sequence;
+                jp->next = o + journalSpan(h.length);
+            }
+            o += journalSpan(h.length);
+        }
+        else {
+            o += JOURNAL_ALIGNMENT;
+        }
+    }
+}
+
+static int
+isErased(const unsigned char *cp, int n)
+{
+    while (n--) {
+        if (*cp++ != 0xFF)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Queue data for writing, waiting for room if necessary
+ */
+static int
+journalQueue(unsigned int address, const char *buf, int n)
+{
+    while (n > 0) {
+        int l = (n > JOURNAL_CHUNK) ? JOURNAL_CHUNK : n;
+        int i = linearFlashQueueWrite(address, buf, l);
+        if (i < 0)
+            return -1;
+        if (i == 0) {
+            linearFlashCheck();
+            checkForWork();
+            continue;
+        }
+        address += l;
+        buf += l;
+        n -= l;
+    }
+    return 0;
+}
+
+/*
+ * Append a record to a table's journal
+ * Returns number of bytes written or -1 on failure.
+ */
+static int
+journalWrite(int fileIndex, const char *buf, int n)
+{
+    struct journal *jp = &journals[fileIndex];
+    const unsigned char *base = regionBase(fileIndex);
+    int size = fileTable[fileIndex].maxSize;
+    int span = journalSpan(n);
+    int o = jp->next;
+    struct journalHeader h;
+
+    /*
+     * Use the next erased space in the current page.
+     * Writing at or into the start of a page erases it.
+     */
+    linearFlashDrain();
+    for (;;) {
+        int inPage;
+        if ((o + span) > size) {
+            if (o == 0)
+                return -1;
+            o = 0;
+            break;
+        }
+        inPage = LINEAR_FLASH_PAGE_SIZE - (o % LINEAR_FLASH_PAGE_SIZE);
+        if (((o % LINEAR_FLASH_PAGE_SIZE) == 0)
+         || isErased(base + o, (span < inPage) ? span : inPage))
+            break;
+        o += JOURNAL_ALIGNMENT;
+    }
+    h.magic = JOURNAL_MAGIC;
+    h.sequence = jp->sequence + 1;
+    h.length = n;
+    h.check = journalChecksum(&h, (const unsigned char *)buf);
+    if ((journalQueue(fileTable[fileIndex].baseAddress + o,
+                                            (char *)&h, sizeof h) < 0)
+     || (journalQueue(fileTable[fileIndex].baseAddress + o + sizeof h,
+                                            buf, n) < 0)
+     || (linearFlashSync() < 0)) {
+        /* Find the newest record and free space again */
+        linearFlashSync();
+        journalScan(fileIndex);
+        return -1;
+    }
+    jp->newest = base + o + sizeof h;
+    jp->sequence = h.sequence;
+    jp->next = o + span;
+    return n;
+}
+
 /*
  * Send an error reply
  */
@@ -170,19 +400,48 @@ replyACK(int block, struct ip_addr *addr, int port)
     pbuf_free(p);
 }
 
+/*
+ * Send an option acknowledgement
+ */
+static void
+replyOACK(const struct session *sp, int hasBlockSize, int hasWindowSize)
+{
+    char buf[64];
+    int l = 0;
+    struct pbuf *p;
+
+    if (hasBlockSize)
+        l += sprintf(buf + l, "blksize%c%d", '\0', sp->blockSize) + 1;
+    if (hasWindowSize)
+        l += sprintf(buf + l, "windowsize%c%d", '\0', sp->windowSize) + 1;
+    p = pbuf_alloc(PBUF_TRANSPORT, sizeof (u16_t) + l, PBUF_RAM);
+    if (p == NULL) {
+        printf("Can't allocate TFTP OACK pbuf\n");
+        return;
+    }
+    *(u16_t *)p->payload = htons(TFTP_OPCODE_OACK);
+    memcpy((u16_t *)p->payload + 1, buf, l);
+    if (debugFlags & DEBUGFLAG_TFTP)
+        printf("TFTP %10u OACK blksize %d windowsize %d\n",
+                    ticks2microsec(sysTicksSinceBoot()), sp->blockSize,
+                                                         sp->windowSize);
+    udp_sendto(pcb, p, (struct ip_addr *)&sp->addr, sp->port);
+    pbuf_free(p);
+}
+
 /*
  * Send a data packet
  */
 static int
-sendBlock(int block, int offset, int bytesLeft, struct ip_addr *addr, int port)
+sendBlock(struct session *sp, int block, int offset, int bytesLeft)
 {
     int l, nSend;
     struct pbuf *p;
     u16_t *p16;
 
     nSend = bytesLeft;
-    if (nSend > TFTP_PAYLOAD_CAPACITY)
-        nSend = TFTP_PAYLOAD_CAPACITY;
+    if (nSend > sp->blockSize)
+        nSend = sp->blockSize;
     l = (2 * sizeof(u16_t)) + nSend;
     p = pbuf_alloc(PBUF_TRANSPORT, l, PBUF_RAM);
     if (p == NULL) {
@@ -193,15 +452,106 @@ sendBlock(int block, int offset, int bytesLeft, struct ip_addr *addr, int port)
     *p16++ = htons(TFTP_OPCODE_DATA);
     *p16++ = htons(block);
     if (nSend)
-        memcpy(p16, ioPtr + offset, nSend);
+        memcpy(p16, sp->ioPtr + offset, nSend);
     if (debugFlags & DEBUGFLAG_TFTP)
         printf("TFTP %10u send %d (block %d) from %d\n",
                     ticks2microsec(sysTicksSinceBoot()), nSend, block, offset);
-    udp_sendto(pcb, p, addr, port);
+    udp_sendto(pcb, p, &sp->addr, sp->port);
     pbuf_free(p);
     return nSend;
 }
 
+/*
+ * Send a window of data packets starting at the given block index
+ * Block indices don't wrap, block numbers do.
+ */
+static void
+sendWindow(struct session *sp)
+{
+    int i, offset;
+    unsigned int blockIndex = sp->sendBase;
+
+    for (i = 0 ; i < sp->windowSize ; i++, blockIndex++) {
+        offset = (blockIndex - 1) * sp->blockSize;
+        if (offset > sp->fileSize)
+            break;
+        sendBlock(sp, blockIndex, offset, sp->fileSize - offset);
+        if ((sp->fileSize - offset) < sp->blockSize)
+            break;
+    }
+}
+
+/*
+ * Acknowledge a received block if it ends a window
+ */
+static void
+ackIfDue(struct session *sp, int block, int isLast, int force)
+{
+    if (force || isLast || (++sp->windowCount >= sp->windowSize)) {
+        replyACK(block, &sp->addr, sp->port);
+        sp->windowCount = 0;
+    }
+}
+
+/*
+ * Session table management
+ * A session that has timed out may be replaced, unless it is writing
+ * flash and still has a block waiting for the write queue.
+ */
+static int
+isBusy(const struct session *sp)
+{
+    if (!sp->isActive)
+        return 0;
+    if ((sp == writer) && pending.isPending)
+        return 1;
+    return (secondsSinceBoot() - sp->lastSeconds) < TRANSFER_TIMEOUT_SECONDS;
+}
+
+static int
+usesFlash(const struct session *sp)
+{
+    return !sp->isRead || (fileTable[sp->fileIndex].preTransmit == NULL);
+}
+
+static void
+endSession(struct session *sp)
+{
+    sp->isActive = 0;
+    if (sp == writer)
+        writer = NULL;
+    if (sp == sharedBufOwner)
+        sharedBufOwner = NULL;
+}
+
+/*
+ * Claim the shared buffer, taking it from a session that has timed out
+ * Returns NULL if another session is using it.
+ */
+static unsigned char *
+claimSharedBuf(struct session *sp)
+{
+    if (sharedBufOwner && (sharedBufOwner != sp)) {
+        if (isBusy(sharedBufOwner))
+            return NULL;
+        endSession(sharedBufOwner);
+    }
+    sharedBufOwner = sp;
+    return sharedBuf;
+}
+
+static struct session *
+findSession(struct ip_addr *addr, u16_t port)
+{
+    struct session *sp;
+
+    for (sp = sessions ; sp < &sessions[TFTP_SESSION_CAPACITY] ; sp++) {
+        if (sp->isActive && (sp->addr.addr == addr->addr) && (sp->port == port))
+            return sp;
+    }
+    return NULL;
+}
+
 /*
  * Filename matcher
  *   Ignore case.
@@ -234,12 +584,7 @@ handlePacket(void *arg, struct udp_pcb *pcb, struct pbuf *p,
 {
     unsigned char *cp = p->payload;
     int opcode = (cp[0] << 8) | cp[1];
-    static int ioOffset;
-    static int bytesLeft;
-    static u16_t lastBlock;
-    static int lastSend;
-    static int fileIndex = -1;
-    static int lastSeconds;
+    struct session *sp = findSession(fromAddr, fromPort);
 
     if (debugFlags & DEBUGFLAG_TFTP) {
         long addr = ntohl(fromAddr->addr);
@@ -255,13 +600,10 @@ handlePacket(void *arg, struct udp_pcb *pcb, struct pbuf *p,
     if ((opcode == TFTP_OPCODE_RRQ) || (opcode == TFTP_OPCODE_WRQ)) {
         char *name = (char *)cp + 2, *mode = NULL;
         int nullCount = 0, i = 2;
-        lastBlock = 0;
-        if ((fileIndex >= 0)
-         && ((secondsSinceBoot() - lastSeconds) < TRANSFER_TIMEOUT_SECONDS)) {
-            replyERR("Busy", fromAddr, fromPort);
-            return;
-        }
-        fileIndex = -1;
+        int fileIndex = -1, isRead = (opcode == TFTP_OPCODE_RRQ);
+        int compressed = 0, flash;
+        int blockSize = TFTP_PAYLOAD_CAPACITY, windowSize = 1;
+        int hasBlockSize = 0, hasWindowSize = 0;
         for (;;) {
             if (i >= p->len) {
                 replyERR("TFTP request too short", fromAddr, fromPort);
@@ -272,16 +614,19 @@ handlePacket(void *arg, struct udp_pcb *pcb, struct pbuf *p,
                 if (nullCount == 1)
                     mode = (char *)cp + i;
                 if (nullCount == 2) {
-                    int f;
+                    int f, l = strlen(name);
                     if (debugFlags & DEBUGFLAG_TFTP)
                         printf("NAME:%s  MODE:%s\n", name, mode);
                     if (strcasecmp(mode, "octet") != 0) {
                         replyERR("Bad Type", fromAddr, fromPort);
                         return;
                     }
+                    compressed = ((l > 4)
+                               && (strcasecmp(name + l - 4, ".lz4") == 0));
+                    if (compressed)
+                        name[l - 4] = '\0';
                     for (f = 0 ; f < FILE_TABLE_SIZE ; f++) {
                         if (match(name, fileTable[f].name)) {
-                            ioOffset = 0;
                             fileIndex = f;
                             break;
                         }
@@ -294,92 +639,242 @@ handlePacket(void *arg, struct udp_pcb *pcb, struct pbuf *p,
             replyERR("Bad Name", fromAddr, fromPort);
             return;
         }
-        if (opcode == TFTP_OPCODE_RRQ) {
+
+        /*
+         * RFC 2347 options -- unrecognized options are ignored
+         */
+        while (i < p->len) {
+            char *option = (char *)cp + i, *value = NULL;
+            while ((i < p->len) && (cp[i] != '\0')) i++;
+            if (++i < p->len) {
+                value = (char *)cp + i;
+                while ((i < p->len) && (cp[i] != '\0')) i++;
+            }
+            if ((i++ >= p->len) || (value == NULL))
+                break;
+            if (debugFlags & DEBUGFLAG_TFTP)
+                printf("OPTION:%s  VALUE:%s\n", option, value);
+            if (strcasecmp(option, "blksize") == 0) {
+                int v = strtol(value, NULL, 10);
+                if (v >= TFTP_MIN_PAYLOAD_CAPACITY) {
+                    if (v > TFTP_MAX_PAYLOAD_CAPACITY)
+                        v = TFTP_MAX_PAYLOAD_CAPACITY;
+                    blockSize = v;
+                    hasBlockSize = 1;
+                }
+            }
+            else if (strcasecmp(option, "windowsize") == 0) {
+                int v = strtol(value, NULL, 10);
+                if (v >= 1) {
+                    if (v > TFTP_WINDOW_CAPACITY)
+                        v = TFTP_WINDOW_CAPACITY;
+                    windowSize = v;
+                    hasWindowSize = 1;
+                }
+            }
+        }
+        if ((windowSize * blockSize) > TFTP_WINDOW_BYTE_LIMIT) {
+            windowSize = TFTP_WINDOW_BYTE_LIMIT / blockSize;
+            if (windowSize < 1)
+                windowSize = 1;
+        }
+        if (compressed && (isRead || fileTable[fileIndex].postReceive)) {
+            replyERR("Can't compress this file", fromAddr, fromPort);
+            return;
+        }
+
+        /*
+         * A repeated request from a client restarts its transfer.
+         * Flash may not be read or written while another session
+         * is writing it and may not be written while being read.
+         */
+        flash = !isRead || (fileTable[fileIndex].preTransmit == NULL);
+        if (sp && (sp == writer) && pending.isPending) {
+            replyERR("Busy", fromAddr, fromPort);
+            return;
+        }
+        if (sp)
+            endSession(sp);
+        if (flash && writer && isBusy(writer)) {
+            replyERR("Busy", fromAddr, fromPort);
+            return;
+        }
+        for (sp = sessions ; sp < &sessions[TFTP_SESSION_CAPACITY] ; sp++) {
+            if (!isRead && isBusy(sp) && usesFlash(sp)) {
+                replyERR("Busy", fromAddr, fromPort);
+                return;
+            }
+        }
+        if (flash) {
+            /* Forget timed-out sessions that would conflict */
+            for (sp = sessions ; sp < &sessions[TFTP_SESSION_CAPACITY] ; sp++) {
+                if (sp->isActive && usesFlash(sp) && (!isRead || !sp->isRead))
+                    endSession(sp);
+            }
+        }
+        for (sp = sessions ; sp < &sessions[TFTP_SESSION_CAPACITY] ; sp++) {
+            if (!isBusy(sp))
+                break;
+        }
+        if (sp == &sessions[TFTP_SESSION_CAPACITY]) {
+            replyERR("Busy", fromAddr, fromPort);
+            return;
+        }
+        endSession(sp);
+        sp->isActive = 1;
+        sp->addr = *fromAddr;
+        sp->port = fromPort;
+        sp->fileIndex = fileIndex;
+        sp->isRead = isRead;
+        sp->lastSeconds = secondsSinceBoot();
+        sp->blockSize = blockSize;
+        sp->windowSize = windowSize;
+        sp->windowCount = 0;
+        sp->ioOffset = 0;
+        sp->lastBlock = 0;
+        sp->ackedOutOfOrder = 0;
+
+        /* Finish (and forget errors from) earlier writes */
+        if (flash)
+            linearFlashSync();
+        if (isRead) {
             int (*fp)(unsigned char *, int) = fileTable[fileIndex].preTransmit;
             if (fp) {
-                bytesLeft = (*fp)(ioBuf, sizeof ioBuf);
-                ioPtr = ioBuf;
+                sp->ioPtr = sp->ioBuf;
+                sp->fileSize = (*fp)(sp->ioPtr, sizeof sp->ioBuf);
+                if (sp->fileSize < 0) {
+                    if ((sp->ioPtr = claimSharedBuf(sp)) == NULL) {
+                        replyERR("Busy", fromAddr, fromPort);
+                        endSession(sp);
+                        return;
+                    }
+                    sp->fileSize = (*fp)(sp->ioPtr, sizeof sharedBuf);
+                }
+                if (sp->fileSize < 0) {
+                    replyERR("Table too big", fromAddr, fromPort);
+                    endSession(sp);
+                    return;
+                }
             }
             else {
-                bytesLeft = getSize(fileIndex);
-                ioPtr = (unsigned char *)(XPAR_LINEAR_FLASH_S_AXI_MEM0_BASEADDR
+                sp->fileSize = getSize(fileIndex);
+                sp->ioPtr = (unsigned char *)(XPAR_LINEAR_FLASH_S_AXI_MEM0_BASEADDR
                                             + fileTable[fileIndex].baseAddress);
             }
-            lastBlock = 1;
-            lastSend = sendBlock(lastBlock, ioOffset, bytesLeft, fromAddr, fromPort);
+            sp->sendBase = 1;
+            if (hasBlockSize || hasWindowSize)
+                replyOACK(sp, hasBlockSize, hasWindowSize);
+            else
+                sendWindow(sp);
+            return;
+        }
+        if (fileTable[fileIndex].postReceive
+         && ((sp->ioPtr = claimSharedBuf(sp)) == NULL)) {
+            replyERR("Busy", fromAddr, fromPort);
+            endSession(sp);
             return;
         }
-        replyACK(0, fromAddr, fromPort);
+        writer = sp;
+        isCompressed = compressed;
+        if (!fileTable[fileIndex].postReceive) {
+            unsigned int written, skipped;
+            linearFlashStatistics(&written, &skipped);
+            startSeconds = secondsSinceBoot();
+            if (isCompressed)
+                lz4StreamInit(fileTable[fileIndex].baseAddress,
+                              fileTable[fileIndex].maxSize);
+        }
+        if (hasBlockSize || hasWindowSize)
+            replyOACK(sp, hasBlockSize, hasWindowSize);
+        else
+            replyACK(0, fromAddr, fromPort);
     }
-    else if ((opcode == TFTP_OPCODE_DATA) && (fileIndex >= 0)) {
+    else if ((opcode == TFTP_OPCODE_DATA) && sp && (sp == writer)) {
         int block = (cp[2] << 8) | cp[3];
-        if (block == lastBlock) {
-            replyACK(block, fromAddr, fromPort);
+        int fileIndex = sp->fileIndex;
+        if (pending.isPending) {
+            /* Previous block will be acknowledged once it has been queued */
         }
-        else if (block == (u16_t)(lastBlock + 1)) {
-            int nBytes = p->len - (2 * sizeof(u16_t));
-            lastBlock = block;
-            if (nBytes > 0) {
-                if ((fileTable[fileIndex].maxSize - ioOffset) < nBytes) {
-                    replyERR("File too big", fromAddr, fromPort);
-                    return;
-                }
-                else {
-                    if (fileTable[fileIndex].postReceive) {
-                        memcpy(ioBuf + ioOffset, cp+4, nBytes);
-                    }
-                    else {
-                        if (linearFlashWrite(fileTable[fileIndex].baseAddress +
-                                                            ioOffset,
-                                                            (char *)(cp+4),
-                                                            nBytes) != nBytes) {
-                            replyERR("Write error", fromAddr, fromPort);
-                            fileIndex = -1;
-                            return;
-                        }
-                    }
-                    ioOffset += nBytes;
-                }
+        else if (block == (u16_t)(sp->lastBlock + 1)) {
+            int nBytes = p->tot_len - (2 * sizeof(u16_t));
+            int isLast = (nBytes < sp->blockSize);
+            sp->lastBlock = block;
+            sp->ackedOutOfOrder = 0;
+            if ((nBytes > sp->blockSize)
+             || (!isCompressed
+              && ((fileTable[fileIndex].maxSize - sp->ioOffset) < nBytes))) {
+                replyERR("File too big", fromAddr, fromPort);
+                endSession(sp);
+                return;
             }
-            if (nBytes < TFTP_PAYLOAD_CAPACITY) {
-                if (fileTable[fileIndex].postReceive) {
+            if (fileTable[fileIndex].postReceive) {
+                unsigned char *buf = sp->ioPtr;
+                if (nBytes > 0) {
+                    pbuf_copy_partial(p, buf + sp->ioOffset, nBytes,
+                                                        2 * sizeof(u16_t));
+                    sp->ioOffset += nBytes;
+                }
+                if (isLast) {
                     int n;
-                    ioBuf[ioOffset] = '\0';
-                    n = (*fileTable[fileIndex].postReceive)(ioBuf, ioOffset);
+                    buf[sp->ioOffset] = '\0';
+                    n = (*fileTable[fileIndex].postReceive)(buf, sp->ioOffset);
+                    endSession(sp);
                     if (n < 0) {
-                        replyERR((char *)ioBuf, fromAddr, fromPort);
+                        replyERR((char *)buf, fromAddr, fromPort);
                         return;
                     }
-                    else if (linearFlashWrite(fileTable[fileIndex].baseAddress,
-                                                    (char *)ioBuf, n) != n) {
+                    else if (journalWrite(fileIndex, (char *)buf, n) != n) {
                         replyERR("Write error", fromAddr, fromPort);
                         return;
                     }
                 }
-                else {
-                    setSize(fileIndex, ioOffset);
-                }
-                fileIndex = -1;
+                ackIfDue(sp, block, isLast, 0);
             }
-            replyACK(block, fromAddr, fromPort);
+            else {
+                pending.block = block;
+                pending.offset = 0;
+                pending.nBytes = nBytes;
+                pending.isLast = isLast;
+                pending.wasStalled = 0;
+                if (nBytes > 0)
+                    pbuf_copy_partial(p, pending.data, nBytes,
+                                                        2 * sizeof(u16_t));
+                pending.isPending = 1;
+                tftpCheck();
+            }
+        }
+        else if ((block == sp->lastBlock) || !sp->ackedOutOfOrder) {
+            /*
+             * Lost ACK or lost/reordered DATA -- acknowledge the last
+             * in-order block so the client restarts its window there.
+             * Send only one such ACK for a window to avoid a storm of
+             * retransmitted windows.
+             */
+            replyACK(sp->lastBlock, fromAddr, fromPort);
+            sp->windowCount = 0;
+            sp->ackedOutOfOrder = 1;
         }
-        lastSeconds = secondsSinceBoot();
+        sp->lastSeconds = secondsSinceBoot();
     }
-    else if ((opcode == TFTP_OPCODE_ACK) && (fileIndex >= 0)) {
+    else if ((opcode == TFTP_OPCODE_ACK) && sp && sp->isRead) {
+        /*
+         * RFC 7440 -- an ACK for any block in the window starts a new
+         * window with the following block.  ACK of block 0 follows an OACK.
+         */
         int block = (cp[2] << 8) | cp[3];
-        if (block == lastBlock) {
-            lastBlock++;
-            ioOffset += lastSend;
-            bytesLeft -= lastSend;
-            if (lastSend == TFTP_PAYLOAD_CAPACITY)
-                lastSend = sendBlock(lastBlock, ioOffset, bytesLeft, fromAddr, fromPort);
+        u16_t delta = block - (u16_t)(sp->sendBase - 1);
+        unsigned int lastIndex = (sp->fileSize / sp->blockSize) + 1;
+        if ((delta >= 1) && (delta <= sp->windowSize)) {
+            sp->sendBase += delta;
+            if (sp->sendBase > lastIndex)
+                endSession(sp);
             else
-                fileIndex = -1;
+                sendWindow(sp);
         }
-        else {
-            lastSend = sendBlock(lastBlock, ioOffset, bytesLeft, fromAddr, fromPort);
+        else if (delta == 0) {
+            sendWindow(sp);
         }
-        lastSeconds = secondsSinceBoot();
+        sp->lastSeconds = secondsSinceBoot();
     }
 }
 
@@ -387,18 +882,101 @@ static void
 tftp_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
               struct ip_addr *fromAddr, u16_t fromPort)
 {
+    uint32_t then = sysTicksSinceBoot();
+
     /*
-     * Processing a TFTP packet can take a long time if it results in a flash
-     * erase operation so it would be good to keep polling for work while
-     * waiting for the erase to complete.
-     * Unfortunately it appears that recursive calls to the network input
-     * routine breaks things, so for now we'll just live with blocking network
-     * input while the erase is active.
+     * Firmware and software images are written to flash through the
+     * write queue so network input isn't blocked while a page is erased.
+     * Tables are small and still written synchronously.
      * Ignore runt packets.
      */
     if (p->len >= (2 * sizeof (u16_t)))
         handlePacket(arg, pcb, p, fromAddr, fromPort);
     pbuf_free(p);
+    profileEnd(PROFILE_TFTP_CALLBACK, then);
+}
+
+/*
+ * Queue pending data and send the deferred acknowledgement
+ * Called from the main loop.
+ */
+void
+tftpCheck(void)
+{
+    int n;
+    unsigned int written, skipped;
+    struct session *sp = writer;
+
+    if (!pending.isPending)
+        return;
+    if (pending.nBytes > 0) {
+        if (isCompressed)
+            n = lz4StreamWrite(pending.data + pending.offset, pending.nBytes);
+        else
+            n = linearFlashQueueWrite(fileTable[sp->fileIndex].baseAddress +
+                                                                sp->ioOffset,
+                                      (char *)pending.data + pending.offset,
+                                      pending.nBytes);
+        if (n < 0) {
+            replyERR(isCompressed ? "Bad compressed data" : "Write error",
+                                                        &sp->addr, sp->port);
+            linearFlashSync();
+            pending.isPending = 0;
+            endSession(sp);
+            return;
+        }
+        pending.offset += n;
+        pending.nBytes -= n;
+        if (!isCompressed)
+            sp->ioOffset += n;
+        if (pending.nBytes > 0) {
+            pending.wasStalled = 1;
+            return;
+        }
+    }
+    if (pending.isLast && isCompressed) {
+        /*
+         * Verify the whole image before its size is recorded
+         */
+        n = lz4StreamFinish();
+        if (n == 0)
+            return;
+        if (n < 0) {
+            replyERR("Bad compressed data", &sp->addr, sp->port);
+            linearFlashSync();
+            pending.isPending = 0;
+            endSession(sp);
+            return;
+        }
+        sp->ioOffset = lz4StreamSize();
+    }
+    if (pending.isLast) {
+        if (linearFlashBusy()) {
+            linearFlashFlush();
+            return;
+        }
+        if (linearFlashSync() < 0) {
+            replyERR("Write error", &sp->addr, sp->port);
+            pending.isPending = 0;
+            endSession(sp);
+            return;
+        }
+        linearFlashStatistics(&written, &skipped);
+        printf("TFTP %s: %d bytes, %u pages written, %u unchanged, %d s\n",
+                                    fileTable[sp->fileIndex].name, sp->ioOffset,
+                                    written, skipped,
+                                    (int)(secondsSinceBoot() - startSeconds));
+        setSize(sp->fileIndex, sp->ioOffset);
+        endSession(sp);
+    }
+
+    /*
+     * Acknowledge a block that had to wait for the flash so that
+     * the client starts a fresh window rather than overrunning us.
+     */
+    ackIfDue(sp, pending.block, pending.isLast, pending.wasStalled);
+    pending.isPending = 0;
+    sp->lastSeconds = secondsSinceBoot();
 }
 
 void tftpInit(void)
@@ -429,12 +1007,13 @@ filesystemReadbacks(void)
 
     for (i = 0 ; i < FILE_TABLE_SIZE ; i++) {
         if (fileTable[i].readback) {
-            cp = (const unsigned char *)(XPAR_LINEAR_FLASH_S_AXI_MEM0_BASEADDR +
-                                         fileTable[i].baseAddress);
+            journalScan(i);
+            cp = journals[i].newest ? journals[i].newest : regionBase(i);
             (*fileTable[i].readback)(cp);
             if (fileTable[i].preTransmit) {
-                const char *cp = (char *)ioBuf;
-                int l = (*fileTable[i].preTransmit)(ioBuf, sizeof ioBuf);
+                /* No transfers are active at startup */
+                const char *cp = (char *)sharedBuf;
+                int l = (*fileTable[i].preTransmit)(sharedBuf, sizeof sharedBuf);
                 int newline = 1;
                 if (l >= 0) {
                     printf("\n%s (%s):\n", fileTable[i].description,
@@ -461,12 +1040,11 @@ filesystemReadbacks(void)
 void
 stashSystemParameters(void)
 {
-    int base = fileTable[FILE_TABLE_PARAMETER_TABLE_INDEX].baseAddress;
     const char *buf = (char *)&systemParameters;
     int count =  sizeof systemParameters;
 
     systemParametersUpdateChecksum();
-    if (linearFlashWrite(base, buf, count) != count)
+    if (journalWrite(FILE_TABLE_PARAMETER_TABLE_INDEX, buf, count) != count)
         printf("Flash write failed!\n");
 }
 
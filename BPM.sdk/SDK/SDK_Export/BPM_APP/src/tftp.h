@@ -7,6 +7,7 @@
 
 void filesystemReadbacks(void);
 void tftpInit(void);
+void tftpCheck(void);
 void stashSystemParameters(void);
 
 #endif
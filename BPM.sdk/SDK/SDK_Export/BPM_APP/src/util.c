@@ -7,16 +7,147 @@
 #include <string.h>
 #include <time.h>
 #include <lwip/def.h>
+#include <netif/xadapter.h>
 #include "afePLL.h"
 #include "console.h"
 #include "evr.h"
 #include "gpio.h"
+#include "linearFlash.h"
+#include "profile.h"
 #include "publisher.h"
 #include "sfp.h"
+#include "tftp.h"
 #include "util.h"
 
 volatile int debugFlags = DEBUGFLAG_SA_TIMING_CHECK;
 
+/*
+ * Cooperative scheduler
+ * A task is due when it has been made ready, when its period has elapsed,
+ * or on every pass if its period is 0.  Tasks run in priority order, but
+ * due critical tasks are run again after each other task that runs.
+ * Tasks that can't nest aren't run from within another task's wait loop
+ * (the flash write completion loop, for example) and no task is reentered.
+ * Runtime of a task includes that of any tasks run from within it.
+ */
+static struct netif *schedNetif;
+
+static void
+networkInput(void)
+{
+    xemacif_input(schedNetif);
+}
+
+static struct task {
+    const char   *name;
+    void        (*handler)(void);
+    uint32_t      period;       /* Sysclk ticks */
+    uint32_t      deadline;     /* Sysclk ticks after becoming due, 0=none */
+    char          isCritical;
+    char          mayNest;
+    char          isRunning;
+    volatile char isReady;
+    volatile uint32_t whenReady;
+    uint32_t      whenRun;
+    uint32_t      runCount;
+    uint32_t      deadlineMisses;
+    uint32_t      maxTicks;
+    unsigned long long totalTicks;
+} tasks[] = {
+    [TASK_NETWORK_INPUT] = { "Network",    networkInput,  0,  0, 1, 0 },
+    [TASK_SA_PUBLISH]    = { "SA publish", publisherSlowAcquisitionCheck,
+                                                0, MS_TO_SYSTICK(1), 1, 1 },
+    [TASK_PUBLISHER]     = { "Publisher",  publisherCheck, 0, 0, 0, 1 },
+    [TASK_FLASH_WRITE]   = { "Flash",      linearFlashCheck, 0, 0, 0, 0 },
+    [TASK_TFTP]          = { "TFTP",       tftpCheck,      0, 0, 0, 0 },
+    [TASK_CONSOLE]       = { "Console",    consoleCheck,
+                                                MS_TO_SYSTICK(1),   0, 0, 0 },
+    [TASK_AFE_CHECK]     = { "AFE",        afeCheck,
+                                                MS_TO_SYSTICK(10),  0, 0, 1 },
+    [TASK_LO_SYNC_CHECK] = { "LO sync",    afeLOsyncCheck,
+                                                MS_TO_SYSTICK(100), 0, 0, 1 },
+    [TASK_SFP_CHECK]     = { "SFP",        sfpCheck,
+                                                MS_TO_SYSTICK(2),   0, 0, 1 },
+};
+static int schedNestLevel;
+
+void
+schedInit(struct netif *netif)
+{
+    schedNetif = netif;
+}
+
+/*
+ * May be called from an interrupt handler
+ */
+void
+schedReady(enum taskId id)
+{
+    tasks[id].whenReady = sysTicksSinceBoot();
+    tasks[id].isReady = 1;
+}
+
+void
+schedSetPeriod(enum taskId id, uint32_t ticks)
+{
+    tasks[id].period = ticks;
+}
+
+const char *
+schedTaskName(enum taskId id)
+{
+    return tasks[id].name;
+}
+
+static int
+schedRunIfDue(struct task *tp)
+{
+    uint32_t now = sysTicksSinceBoot();
+    uint32_t whenDue, ticks;
+
+    if (tp->isRunning || ((schedNestLevel != 0) && !tp->mayNest))
+        return 0;
+    if (tp->isReady) {
+        whenDue = tp->whenReady;
+        tp->isReady = 0;
+    }
+    else if (tp->period == 0) {
+        whenDue = now;
+    }
+    else if ((tp->period != TASK_PERIOD_WHEN_READY)
+          && ((now - tp->whenRun) >= tp->period)) {
+        whenDue = tp->whenRun + tp->period;
+    }
+    else {
+        return 0;
+    }
+    if (tp->deadline && ((now - whenDue) > tp->deadline))
+        tp->deadlineMisses++;
+    tp->whenRun = now;
+    tp->isRunning = 1;
+    schedNestLevel++;
+    (*tp->handler)();
+    schedNestLevel--;
+    tp->isRunning = 0;
+    ticks = sysTicksSinceBoot() - now;
+    if (ticks > tp->maxTicks) tp->maxTicks = ticks;
+    tp->totalTicks += ticks;
+    tp->runCount++;
+    profileRecord(tp - tasks, ticks);
+    return 1;
+}
+
+static void
+schedRunCritical(void)
+{
+    int i;
+
+    for (i = 0 ; i < TASK_COUNT ; i++) {
+        if (tasks[i].isCritical)
+            schedRunIfDue(&tasks[i]);
+    }
+}
+
 /*
  * See if there's stuff to do.
  * Called from main processing loop and from flash operation completion loop.
@@ -24,11 +155,45 @@ volatile int debugFlags = DEBUGFLAG_SA_TIMING_CHECK;
 void
 checkForWork(void)
 {
-    afeCheck();
-    sfpCheck();
-    afeLOsyncCheck();
-    publisherCheck();
-    consoleCheck();
+    int i;
+
+    schedRunCritical();
+    for (i = 0 ; i < TASK_COUNT ; i++) {
+        if (!tasks[i].isCritical && schedRunIfDue(&tasks[i]))
+            schedRunCritical();
+    }
+}
+
+/*
+ * Show task runtime statistics
+ */
+void
+schedShowStatistics(int clear)
+{
+    int i;
+    const int ticksPerUs = XPAR_MICROBLAZE_FREQ / 1000000;
+
+    printf("       Task   Period(us)         Runs  Mean(us)  Max(us)  Late\n");
+    for (i = 0 ; i < TASK_COUNT ; i++) {
+        struct task *tp = &tasks[i];
+        printf("%11s ", tp->name);
+        if (tp->period == TASK_PERIOD_WHEN_READY)
+            printf("%12s ", "ready");
+        else
+            printf("%12u ", (unsigned int)(tp->period / ticksPerUs));
+        uintPrint(tp->runCount);
+        printf(" %9u %8u %5u\n",
+               tp->runCount ? (unsigned int)((tp->totalTicks / tp->runCount) /
+                                                             ticksPerUs) : 0,
+               (unsigned int)(tp->maxTicks / ticksPerUs),
+               (unsigned int)tp->deadlineMisses);
+        if (clear) {
+            tp->runCount = 0;
+            tp->deadlineMisses = 0;
+            tp->maxTicks = 0;
+            tp->totalTicks = 0;
+        }
+    }
 }
 
 /*
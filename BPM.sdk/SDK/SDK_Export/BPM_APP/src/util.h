@@ -5,6 +5,8 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stdint.h>
+
 #define DEBUGFLAG_SA_TIMING_CHECK               0x8000
 #define DEBUGFLAG_FILTER_IMPULSE_RESPONSE  0x2000
 #define DEBUGFLAG_ALTERNATE_FA_CHANNELS    0x1000
@@ -24,6 +26,28 @@ extern char firmwareRevision[];
 extern char softwareRevision[];
 void setRevisionStrings(void);
 
+/*
+ * Cooperative scheduler
+ * Tasks are listed in priority order, highest first.
+ */
+enum taskId { TASK_NETWORK_INPUT,
+              TASK_SA_PUBLISH,
+              TASK_PUBLISHER,
+              TASK_FLASH_WRITE,
+              TASK_TFTP,
+              TASK_CONSOLE,
+              TASK_AFE_CHECK,
+              TASK_LO_SYNC_CHECK,
+              TASK_SFP_CHECK,
+              TASK_COUNT };
+#define TASK_PERIOD_WHEN_READY  0xFFFFFFFF /* Run only when made ready */
+
+struct netif;
+void schedInit(struct netif *netif);
+void schedReady(enum taskId id);
+void schedSetPeriod(enum taskId id, uint32_t ticks);
+const char *schedTaskName(enum taskId id);
+void schedShowStatistics(int clear);
 void checkForWork(void);
 void criticalWarning(const char *msg);
 void fatal(const char *msg);
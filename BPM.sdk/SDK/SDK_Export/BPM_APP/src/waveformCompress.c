@@ -0,0 +1,263 @@
+/*
+ * Lossless compression of waveform data blocks
+ * This file and waveformCompress.h are shared with the IOC.
+ *
+ * Each sample consists of four channels of 16 bit (ADC recorder) or
+ * 32 bit (all other recorders) signed values.  Each channel is coded
+ * independently as the difference from the previous sample in the block
+ * (the first sample in a block is coded as the difference from 0).
+ * The differences are zig-zag mapped to unsigned values which are then
+ * Rice coded with a per-channel, per-block parameter k.
+ *
+ * Compressed block layout:
+ *   4 bytes:   k for channels 0 through 3
+ *   remainder: bit stream, most significant bit first, samples in order
+ *              and channels in order within each sample.  The final byte
+ *              is padded with 0 bits.
+ * Each value u is coded as q=u>>k 1 bits, a 0 bit, then the k least
+ * significant bits of u.  Values with q >= ESCAPE_COUNT are coded as
+ * ESCAPE_COUNT 1 bits followed by all 32 bits of u.
+ */
+#include <string.h>
+#include "waveformCompress.h"
+
+#define CHANNEL_COUNT   4
+#define ESCAPE_COUNT    24
+
+struct bitWriter {
+    unsigned char *cp;
+    unsigned char *end;
+    epicsUInt32    acc;
+    int            nBits;
+    int            overflow;
+};
+
+struct bitReader {
+    const unsigned char *cp;
+    const unsigned char *end;
+    epicsUInt32          acc;
+    int                  nBits;
+    int                  underflow;
+};
+
+/*
+ * Write at most 16 bits
+ */
+static void
+putBits(struct bitWriter *bw, epicsUInt32 v, int n)
+{
+    bw->acc = (bw->acc << n) | (v & ((1UL << n) - 1));
+    bw->nBits += n;
+    while (bw->nBits >= 8) {
+        bw->nBits -= 8;
+        if (bw->cp == bw->end) {
+            bw->overflow = 1;
+            return;
+        }
+        *bw->cp++ = bw->acc >> bw->nBits;
+    }
+}
+
+static void
+putValue(struct bitWriter *bw, epicsUInt32 u, int k)
+{
+    epicsUInt32 q = u >> k;
+
+    if (q < ESCAPE_COUNT) {
+        while (q > 16) {
+            putBits(bw, 0xFFFF, 16);
+            q -= 16;
+        }
+        putBits(bw, 0xFFFF, q);
+        putBits(bw, 0, 1);
+        if (k > 16) {
+            putBits(bw, u >> 16, k - 16);
+            k = 16;
+        }
+        putBits(bw, u, k);
+    }
+    else {
+        putBits(bw, 0xFFFF, 16);
+        putBits(bw, 0xFFFF, ESCAPE_COUNT - 16);
+        putBits(bw, u >> 16, 16);
+        putBits(bw, u, 16);
+    }
+}
+
+/*
+ * Read at most 16 bits
+ */
+static epicsUInt32
+getBits(struct bitReader *br, int n)
+{
+    while (br->nBits < n) {
+        epicsUInt32 c = 0;
+        if (br->cp == br->end)
+            br->underflow = 1;
+        else
+            c = *br->cp++;
+        br->acc = (br->acc << 8) | c;
+        br->nBits += 8;
+    }
+    br->nBits -= n;
+    return (br->acc >> br->nBits) & ((1UL << n) - 1);
+}
+
+static epicsUInt32
+getValue(struct bitReader *br, int k)
+{
+    epicsUInt32 q = 0, u;
+
+    while ((q < ESCAPE_COUNT) && getBits(br, 1))
+        q++;
+    if (q == ESCAPE_COUNT) {
+        u = getBits(br, 16) << 16;
+        return u | getBits(br, 16);
+    }
+    u = q << k;
+    if (k > 16) {
+        u |= getBits(br, k - 16) << 16;
+        k = 16;
+    }
+    return u | getBits(br, k);
+}
+
+static epicsInt32
+fetch(const char *cp, int channel, unsigned int bytesPerSample)
+{
+    if (bytesPerSample == 8)
+        return ((const epicsInt16 *)cp)[channel];
+    return ((const epicsInt32 *)cp)[channel];
+}
+
+static epicsUInt32
+zigzag(epicsInt32 v, epicsInt32 previous)
+{
+    epicsUInt32 d = (epicsUInt32)v - (epicsUInt32)previous;
+    return (d << 1) ^ (epicsUInt32)((epicsInt32)d >> 31);
+}
+
+/*
+ * Compress a block
+ */
+int
+wfrCompress(unsigned char *out, unsigned int outCapacity,
+            const char *in, unsigned int inCapacity,
+            unsigned int inOffset, unsigned int inLength,
+            unsigned int bytesPerSample)
+{
+    unsigned int sampleCount = inLength / bytesPerSample;
+    unsigned int s, offset;
+    epicsInt32 previous[CHANNEL_COUNT];
+    unsigned long long sum[CHANNEL_COUNT];
+    int k[CHANNEL_COUNT];
+    struct bitWriter bw;
+    int c;
+
+    if ((outCapacity < CHANNEL_COUNT) || (sampleCount == 0))
+        return -1;
+
+    /*
+     * Choose Rice parameters from mean of mapped differences
+     */
+    for (c = 0 ; c < CHANNEL_COUNT ; c++) {
+        previous[c] = 0;
+        sum[c] = 0;
+    }
+    for (s = 0, offset = inOffset ; s < sampleCount ; s++) {
+        const char *cp = in + offset;
+        for (c = 0 ; c < CHANNEL_COUNT ; c++) {
+            epicsInt32 v = fetch(cp, c, bytesPerSample);
+            sum[c] += zigzag(v, previous[c]);
+            previous[c] = v;
+        }
+        offset += bytesPerSample;
+        if (offset >= inCapacity)
+            offset = 0;
+    }
+    for (c = 0 ; c < CHANNEL_COUNT ; c++) {
+        epicsUInt32 mean = sum[c] / sampleCount;
+        k[c] = 0;
+        while ((mean >>= 1) != 0)
+            k[c]++;
+        out[c] = k[c];
+        previous[c] = 0;
+    }
+
+    /*
+     * Emit the bit stream
+     */
+    bw.cp = out + CHANNEL_COUNT;
+    bw.end = out + outCapacity;
+    bw.acc = 0;
+    bw.nBits = 0;
+    bw.overflow = 0;
+    for (s = 0, offset = inOffset ; s < sampleCount ; s++) {
+        const char *cp = in + offset;
+        for (c = 0 ; c < CHANNEL_COUNT ; c++) {
+            epicsInt32 v = fetch(cp, c, bytesPerSample);
+            putValue(&bw, zigzag(v, previous[c]), k[c]);
+            previous[c] = v;
+        }
+        if (bw.overflow)
+            return -1;
+        offset += bytesPerSample;
+        if (offset >= inCapacity)
+            offset = 0;
+    }
+    if (bw.nBits)
+        putBits(&bw, 0, 8 - bw.nBits);
+    if (bw.overflow)
+        return -1;
+    return bw.cp - out;
+}
+
+/*
+ * Reference decoder
+ */
+int
+wfrDecompress(unsigned char *out, unsigned int outLength,
+              const unsigned char *in, unsigned int inLength,
+              unsigned int bytesPerSample)
+{
+    unsigned int sampleCount = outLength / bytesPerSample;
+    unsigned int s;
+    epicsInt32 previous[CHANNEL_COUNT];
+    int k[CHANNEL_COUNT];
+    struct bitReader br;
+    int c;
+
+    if ((inLength < CHANNEL_COUNT)
+     || ((bytesPerSample != 8) && (bytesPerSample != 16)))
+        return -1;
+    for (c = 0 ; c < CHANNEL_COUNT ; c++) {
+        k[c] = in[c];
+        if (k[c] > 31)
+            return -1;
+        previous[c] = 0;
+    }
+    br.cp = in + CHANNEL_COUNT;
+    br.end = in + inLength;
+    br.acc = 0;
+    br.nBits = 0;
+    br.underflow = 0;
+    for (s = 0 ; s < sampleCount ; s++) {
+        for (c = 0 ; c < CHANNEL_COUNT ; c++) {
+            epicsUInt32 u = getValue(&br, k[c]);
+            epicsInt32 v = (epicsUInt32)previous[c] + ((u >> 1) ^ -(u & 1));
+            if (bytesPerSample == 8) {
+                epicsInt16 v16 = v;
+                memcpy(out + (c * sizeof v16), &v16, sizeof v16);
+                v = v16;
+            }
+            else {
+                memcpy(out + (c * sizeof v), &v, sizeof v);
+            }
+            previous[c] = v;
+        }
+        if (br.underflow)
+            return -1;
+        out += bytesPerSample;
+    }
+    return 0;
+}
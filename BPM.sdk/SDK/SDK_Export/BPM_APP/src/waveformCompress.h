@@ -0,0 +1,27 @@
+/*
+ * Lossless compression of waveform data blocks
+ * This file and waveformCompress.c are shared with the IOC.
+ */
+
+#ifndef _WAVEFORM_COMPRESS_H_
+#define _WAVEFORM_COMPRESS_H_
+
+#include "bpmProtocol.h"
+
+/*
+ * Returns compressed length, or -1 if the block won't fit in outCapacity.
+ * The input is a ring buffer of inCapacity bytes which may wrap.
+ */
+int wfrCompress(unsigned char *out, unsigned int outCapacity,
+                const char *in, unsigned int inCapacity,
+                unsigned int inOffset, unsigned int inLength,
+                unsigned int bytesPerSample);
+
+/*
+ * Returns 0 on success, -1 if the compressed block is malformed.
+ */
+int wfrDecompress(unsigned char *out, unsigned int outLength,
+                  const unsigned char *in, unsigned int inLength,
+                  unsigned int bytesPerSample);
+
+#endif
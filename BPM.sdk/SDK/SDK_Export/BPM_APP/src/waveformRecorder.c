@@ -2,13 +2,19 @@
  * Waveform recorders
  */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <xil_cache.h>
 #include <xparameters.h>
 #include "bpmProtocol.h"
 #include "waveformRecorder.h"
+#include "waveformCompress.h"
+#include "evr.h"
 #include "gpio.h"
+#include "profile.h"
+#include "publisher.h"
+#include "systemParameters.h"
 #include "util.h"
 #include "waveformRecorder.h"
 
@@ -45,6 +51,9 @@ void microblaze_flush_cache_ext(void); /* Prototype Xilinx omitted */
 #define WR_REG_OFFSET_ADDRESS_POINTER      3
 #define WR_REG_OFFSET_TIMESTAMP_SECONDS    4
 #define WR_REG_OFFSET_TIMESTAMP_TICKS      5
+#define WR_REG_OFFSET_SEGMENT_CONFIG       4 /* Write-only alias */
+#define WR_REG_OFFSET_SEGMENT_SELECT       5 /* Write-only alias */
+#define WR_SEGMENT_SELECT                  0x80000000
 
 
 /*
@@ -60,13 +69,136 @@ void microblaze_flush_cache_ext(void); /* Prototype Xilinx omitted */
  */
 #define TIMEOUT_TICKS XPAR_MICROBLAZE_FREQ
 #define RETRY_LIMIT   10
+#define REF_PBUF_CAPACITY 32
+
+/*
+ * Transfer scheduling
+ * Recorders with higher priority values are served first.  Each pass
+ * through the publisher work-check routine is limited in packets and
+ * bytes, and stops early when too many packets handed to the network
+ * are still awaiting transmission.  A reference is kept to each packet
+ * handed out until the network driver has released it.
+ */
+#define PRIORITY_MAX            7
+#define PASS_PACKET_LIMIT       8
+#define PASS_BYTE_LIMIT         (32*1024)
+#define TX_QUEUE_LIMIT          24
+static struct pbuf *txPbuf[TX_QUEUE_LIMIT];
+static unsigned int txPbufCount;
+
+/*
+ * Envelope computation and segment packing are spread across passes
+ */
+#define ENVELOPE_SAMPLES_PER_PASS   4096
+#define PACK_BYTES_PER_PASS         (256*1024)
+
+#define CHANNEL_COUNT       4
+#define ALL_CHANNELS        ((1 << CHANNEL_COUNT) - 1)
+
+/*
+ * Each recorder alternates between buffers so that it can be
+ * rearmed while the previous acquisition is still being sent.
+ * Acquisition details are latched when the recorder fills since
+ * the recorder registers change when it is rearmed.
+ */
+#define BUFFERS_PER_RECORDER    2
+struct capture {
+    enum { CAP_FREE,        /* Contents of no interest */
+           CAP_FILLING,     /* Recorder is (or may be) writing here */
+           CAP_PACKING,     /* Full, segments being moved together */
+           CAP_QUEUED,      /* Full and waiting to be sent */
+           CAP_DRAINING,    /* Being sent to one or more subscribers */
+           CAP_DONE }       /* Sent, but kept for region of interest */
+                    state;
+    char           *base;
+    unsigned int    waveformNumber;
+    unsigned int    pretrigCount;
+    unsigned int    count;
+    char           *nextAddress;
+    epicsUInt32     seconds;
+    epicsUInt32     ticks;
+    unsigned int    segmentCount;
+    unsigned int    segmentShift;
+    unsigned int    samplesPerSegment;
+    epicsUInt32     segmentSeconds[BPM_PROTOCOL_SEGMENT_CAPACITY];
+    epicsUInt32     segmentTicks[BPM_PROTOCOL_SEGMENT_CAPACITY];
+    char           *segmentEnd[BPM_PROTOCOL_SEGMENT_CAPACITY];
+    enum { PACK_START,
+           PACK_REVERSE_HEAD,
+           PACK_REVERSE_TAIL,
+           PACK_REVERSE_REGION,
+           PACK_MOVE }  packStep;
+    unsigned int    packSegment;    /* Segment being moved */
+    char           *packLo;         /* Reversal or move cursors */
+    char           *packHi;
+    char           *packDst;
+    int             isDiagnostic;
+    unsigned int    unsentMask;     /* Subscribers yet to be sent this */
+    unsigned int    activeCount;    /* Transfers in progress */
+
+    /*
+     * Envelope preview
+     * Computed once, a piece at a time, and sent to each subscriber
+     * as points become available.
+     */
+    unsigned int    envStartByteOffset;
+    unsigned int    envSampleCount;
+    unsigned int    envPointCount;
+    unsigned int    envSamplesPerPoint;
+    unsigned int    envPointIndex;  /* Points complete */
+    unsigned int    envSampleIndex; /* Samples in current point */
+    epicsInt32      envMin[BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT];
+    epicsInt32      envMax[BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT];
+    int64_t         envSum[BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT];
+    struct bpmEnvelopePoint envPoint[BPM_PROTOCOL_ENVELOPE_POINT_LIMIT]
+                                    [BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT];
+};
+
+/*
+ * Transfer of acquisitions from a recorder to one subscriber
+ */
+struct recorder;
+struct transfer {
+    struct recorder *rp;
+    int             subscriber;
+    enum { CS_IDLE, CS_ENVELOPE, CS_HEADER, CS_ACTIVE } commState;
+    char           *acqBuf;
+    int             xferIndex;
+    unsigned int    waveformNumber;
+    unsigned int    startByteOffset;
+    unsigned int    byteCount;
+    unsigned int    outBytesPerSample;
+    unsigned int    channelMask;
+    unsigned int    blockSize;
+    unsigned int    blockCount;
+    int             isCompressed;
+    int             isRoi;
+    int             roiPending;
+    uint32_t        sysTicksAtPreviousPacket;
+    unsigned int    retryCount;
+    unsigned int    txBlock;
+
+    /*
+     * Windowed transfer state
+     * In windowed mode txBlock is the next block never yet sent.
+     */
+    int             isWindowed;
+    unsigned int    windowSize;
+    unsigned int    ackBlock;
+    unsigned int    retxBlock;
+    unsigned int    retxLimit;
+    uint32_t        sack[BPM_PROTOCOL_WAVEFORM_WINDOW_CAPACITY/32];
+
+    /*
+     * Envelope preview
+     */
+    unsigned int    envFirstPoint;  /* Next point to send */
+};
 
 /*
  * Information for a single recorder
  */
 struct recorder {
-    enum { CS_IDLE, CS_HEADER, CS_ACTIVE } commState;
-    char           *acqBuf;
     unsigned int    acqByteCapacity;
     unsigned int    acqSampleCapacity;
     unsigned int    regBase;
@@ -77,16 +209,92 @@ struct recorder {
     unsigned int    acqCount;
     unsigned int    maxPretrigger;
     unsigned int    recorderNumber;
-    unsigned int    waveformNumber;
-    unsigned int    startByteOffset;
-    unsigned int    bytesLeft;
-    unsigned int    bytesInPreviousPacket;
-    uint32_t        sysTicksAtPreviousPacket;
-    unsigned int    retryCount;
-    int             txBlock;
+    unsigned int    envelopePointCount;
+
+    /*
+     * Transfers to each subscriber
+     */
+    struct transfer xfer[PUBLISHER_SUBSCRIBER_CAPACITY];
+    int             xferRotor;
+
+    /*
+     * Zero-copy data packets referring to acquisition buffer
+     */
+    struct pbuf    *refPbuf[REF_PBUF_CAPACITY];
+    unsigned char   refBuffer[REF_PBUF_CAPACITY];
+    unsigned int    refPbufCount;
+    int             armPending;
+    epicsUInt32     armPendingCSR;
+
+    /*
+     * Scheduling and throughput statistics
+     */
+    unsigned int    priority;
+    uint32_t        packetsSent;
+    uint32_t        bytesSent;
+    uint32_t        blocksCompressed;
+    uint32_t        blocksResent;
+    uint32_t        timeouts;
+    uint32_t        transfersCompleted;
+    uint32_t        capturesDropped;
+    uint32_t        bytesAtPreviousShow;
+    uint32_t        sysTicksAtPreviousShow;
+
+    /*
+     * Acquisition buffers
+     */
+    struct capture  capture[BUFFERS_PER_RECORDER];
+    int             fillIndex;
+    int             latestIndex;
+    unsigned int    acquisitionNumber;
+
+    /*
+     * Region of interest readout of most recent acquisition
+     */
+    unsigned int    roiWaveformNumber;
+    unsigned int    roiFirstSample;
+    unsigned int    roiSampleCount;
+    unsigned int    roiChannelMask;
+
+    /*
+     * Segmented acquisition
+     */
+    unsigned int    segmentCount;
 };
 static struct recorder recorder[BPM_PROTOCOL_RECORDER_COUNT];
 
+/*
+ * Data block size and options requested by each subscriber
+ */
+static struct subscription {
+    unsigned int payloadCapacity;
+    unsigned int options;
+} subscription[PUBLISHER_SUBSCRIBER_CAPACITY];
+static unsigned int subscriberMask;
+
+/*
+ * Continuous fast acquisition stream
+ * Sample counts are free-running.  Since the recorder capacity is a
+ * power of two the ring buffer index is the count modulo the capacity.
+ * Each packet is time stamped with the time of its first sample, found
+ * by working back from the time at which the most recent sample was
+ * seen.  Packets that fall so far behind that the recorder is about to
+ * overwrite them are dropped.
+ */
+#define STREAM_GUARD_SAMPLES    8   /* Allow for recorder burst in progress */
+#define STREAM_LAG_MARGIN(rp)   ((rp)->acqSampleCapacity / 8)
+static struct stream {
+    struct recorder *rp;
+    char            *base;
+    unsigned int     samplesPerPacket;
+    unsigned int     writeIndex;
+    unsigned int     writtenCount;
+    unsigned int     sentCount;
+    epicsUInt32      packetNumber;
+    uint32_t         packetsSent;
+    uint32_t         packetsDropped;
+} stream;
+
 static void
 showWfrReg(const char *msg, int r)
 {
@@ -122,8 +330,9 @@ wrWrite(struct recorder *rp, int regOffset, uint32_t val)
 void
 wfrInit(void)
 {
-    int i, r;
+    int i, r, b, x;
     int bytesPerSample, pretrigCount, acqCount, maxPretrig, acqSampleCapacity;
+    int priority;
     struct recorder *rp;
     static uint32_t iBufBase;
 
@@ -146,6 +355,7 @@ wfrInit(void)
             maxPretrig = ADC_WFR_HW_PRETRIG_COUNT;
             pretrigCount = ADC_WFR_HW_PRETRIG_COUNT;
             acqCount = 1024 * 1024;
+            priority = 1;
             break;
 
         case 1:
@@ -155,6 +365,7 @@ wfrInit(void)
             maxPretrig = GPIO_RECORDER_TBT_SAMPLE_CAPACITY;
             pretrigCount = 40;
             acqCount = 10000;
+            priority = 5;
             break;
 
         case 2:
@@ -164,6 +375,7 @@ wfrInit(void)
             maxPretrig = GPIO_RECORDER_FA_SAMPLE_CAPACITY;
             pretrigCount = 40;
             acqCount = 1000;
+            priority = 6;
             break;
 
         case 3: case 4:
@@ -173,6 +385,7 @@ wfrInit(void)
             maxPretrig = GPIO_RECORDER_PT_SAMPLE_CAPACITY;
             pretrigCount = 40;
             acqCount = 1000;
+            priority = 3;
             break;
 
         default: fatal("Waveform recorder defines mangled!");
@@ -182,17 +395,32 @@ wfrInit(void)
         rp->pretrigCount = pretrigCount;
         rp->acqCount = acqCount;
         rp->maxPretrigger = maxPretrig;
+        rp->priority = priority;
+        rp->roiChannelMask = ALL_CHANNELS;
         rp->bytesPerSample = bytesPerSample;
-        rp->commState = CS_IDLE;
         rp->recorderNumber = i;
-        rp->waveformNumber = 1;
-        rp->acqBuf = (char *)iBufBase;
-        wrWrite(rp, WR_REG_OFFSET_ADDRESS_POINTER, iBufBase);
-        rp->csrModeBits = WR_CSR_RESET_BAR_MODE;
-        wrWrite(rp, WR_REG_OFFSET_CSR, rp->csrModeBits);
+        rp->acquisitionNumber = 1;
+        for (x = 0 ; x < PUBLISHER_SUBSCRIBER_CAPACITY ; x++) {
+            rp->xfer[x].rp = rp;
+            rp->xfer[x].subscriber = x;
+            rp->xfer[x].commState = CS_IDLE;
+            rp->xfer[x].xferIndex = -1;
+        }
         rp->acqSampleCapacity = acqSampleCapacity;
         rp->acqByteCapacity = bytesPerSample * acqSampleCapacity;
-        iBufBase += rp->acqByteCapacity;
+        for (b = 0 ; b < BUFFERS_PER_RECORDER ; b++) {
+            /* Recorder requires buffer to be aligned to its size */
+            iBufBase = (iBufBase + rp->acqByteCapacity - 1) &
+                                                    ~(rp->acqByteCapacity - 1);
+            rp->capture[b].base = (char *)iBufBase;
+            rp->capture[b].state = CAP_FREE;
+            iBufBase += rp->acqByteCapacity;
+        }
+        rp->fillIndex = 0;
+        rp->latestIndex = -1;
+        wrWrite(rp, WR_REG_OFFSET_ADDRESS_POINTER, (uint32_t)rp->capture[0].base);
+        rp->csrModeBits = WR_CSR_RESET_BAR_MODE;
+        wrWrite(rp, WR_REG_OFFSET_CSR, rp->csrModeBits);
     }
 }
 
@@ -208,337 +436,1789 @@ recorderPointer(int recorderIndex)
 }
 
 /*
- * Create a data packet
+ * Zero-copy data packets point directly into the acquisition buffer.
+ * A reference is kept to the first buffer segment of each so that the
+ * recorder is not rearmed, and the buffer overwritten, while the network
+ * driver still has a packet queued.  Segments no longer referred to by
+ * anything but the recorder are released here.
  */
-static struct pbuf *
-dataPacket(struct recorder *rp)
+static void
+releaseRefPbufs(struct recorder *rp)
 {
-    int offset, dataLength, packetLength;
-    struct bpmWaveformData *dp;
-    struct pbuf *p = NULL;
-
-    offset = (rp->startByteOffset +
-              (rp->txBlock * BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY)) %
-                                                            rp->acqByteCapacity;
-    dataLength = rp->bytesLeft;
-    if (dataLength > 0) {
-        if (dataLength > BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY)
-            dataLength = BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY;
-        packetLength = sizeof(*dp) -
-                        (BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY - dataLength);
+    unsigned int i = 0;
 
-        /*
-         * Create the packet
-         */
-        p = pbuf_alloc(PBUF_TRANSPORT, packetLength, PBUF_RAM);
-        if (p) {
-            dp = (struct bpmWaveformData *)p->payload;
-            dp->magic = BPM_PROTOCOL_MAGIC_WAVEFORM_DATA;
-            dp->recorderNumber = rp->recorderNumber;
-            dp->waveformNumber = rp->waveformNumber;
-            dp->blockNumber = rp->txBlock;
-            if ((offset + dataLength) <= rp->acqByteCapacity) {
-                memcpy(dp->payload, rp->acqBuf + offset, dataLength);
-            }
-            else {
-                /* Handle ring buffer wraparound */
-                unsigned int l1, l2;
-                l1 = rp->acqByteCapacity - offset;
-                memcpy(dp->payload, rp->acqBuf + offset, l1);
-                offset = 0;
-                l2 = dataLength - l1;
-                memcpy(dp->payload + l1, rp->acqBuf + offset, l2);
-            }
-            rp->sysTicksAtPreviousPacket = sysTicksSinceBoot();
-            if (debugFlags & DEBUGFLAG_WAVEFORM_XFER)
-                printf("WFR %d block %d size %d\n", rp->recorderNumber,
-                                              (int)dp->blockNumber, dataLength);
+    while (i < rp->refPbufCount) {
+        if (rp->refPbuf[i]->ref == 1) {
+            pbuf_free(rp->refPbuf[i]);
+            rp->refPbufCount--;
+            rp->refPbuf[i] = rp->refPbuf[rp->refPbufCount];
+            rp->refBuffer[i] = rp->refBuffer[rp->refPbufCount];
+        }
+        else {
+            i++;
         }
     }
-    if (p) {
-        rp->commState = CS_ACTIVE;
-        rp->bytesInPreviousPacket = dataLength;
-    }
-    else {
-        rp->commState = CS_IDLE;
-        rp->bytesInPreviousPacket = 0;
+}
+
+/*
+ * Keep track of a packet about to be handed to the network
+ */
+static struct pbuf *
+txTrack(struct pbuf *p)
+{
+    if (p && (txPbufCount < TX_QUEUE_LIMIT)) {
+        pbuf_ref(p);
+        txPbuf[txPbufCount++] = p;
     }
     return p;
 }
 
 /*
- * Called from publisher packet handler.
- * Hand back a pointer to the data packet to be transmitted.
+ * Release packets the network driver has finished sending
  */
-struct pbuf *
-wfrAckPacket(struct bpmWaveformAck *ackp)
+static void
+releaseTxPbufs(void)
 {
-    struct recorder *rp = recorderPointer(ackp->recorderNumber);
+    unsigned int i = 0;
 
-    /*
-     * Sanity check
-     */
-    if ((rp == NULL)
-     || ((rp->commState != CS_ACTIVE) && (rp->commState != CS_HEADER))
-     || (ackp->magic != BPM_PROTOCOL_MAGIC_WAVEFORM_ACK)
-     || (ackp->waveformNumber != rp->waveformNumber)
-     || (ackp->blockNumber != rp->txBlock))
-        return NULL;
-    if (debugFlags & DEBUGFLAG_WAVEFORM_XFER)
-        printf("WFR %d ACK %d\n", (int)ackp->recorderNumber,
-                                  (int)ackp->blockNumber);
-
-    /*
-     * Determine contents
-     */
-    rp->retryCount = 0;
-    if (rp->commState != CS_HEADER) {
-        rp->txBlock++;
-        if (rp->bytesInPreviousPacket < rp->bytesLeft) {
-            rp->bytesLeft -= rp->bytesInPreviousPacket;
+    while (i < txPbufCount) {
+        if (txPbuf[i]->ref == 1) {
+            pbuf_free(txPbuf[i]);
+            txPbuf[i] = txPbuf[--txPbufCount];
         }
         else {
-            rp->bytesLeft = 0;
+            i++;
         }
     }
-    return dataPacket(rp);
 }
 
 /*
- * Create a header packet
+ * See if the network driver may still be using a buffer
  */
-static struct pbuf *
-headerPacket(struct recorder *rp)
+static int
+bufferIsReferenced(struct recorder *rp, int bufferIndex)
 {
-    struct pbuf *p;
-    struct bpmWaveformHeader *hp;
-    unsigned int count;
+    unsigned int i;
 
-    count = WR_READ(rp, WR_REG_OFFSET_ACQUISITION_COUNT);
-    if (count > rp->acqCount)
-        count = rp->acqCount;
-    if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
-        showRec(rp);
-    if (rp->recorderNumber == 0) {
-        /*
-         * ADC recorder uses linear buffer with fixed trigger samples.
-         */
-        rp->startByteOffset = (ADC_WFR_HW_PRETRIG_COUNT - rp->pretrigCount) *
-                                                            rp->bytesPerSample;
-    }
-    else {
-        /* Other recorders use a ring buffer */
-        char *nextAddress = (char *)WR_READ(rp, WR_REG_OFFSET_ADDRESS_POINTER);
-        rp->startByteOffset = ((nextAddress - rp->acqBuf) +
-                               rp->acqByteCapacity -
-                               (rp->acqCount * rp->bytesPerSample)) %
-                                                            rp->acqByteCapacity;
-    }
-    p = pbuf_alloc(PBUF_TRANSPORT, sizeof(*hp), PBUF_RAM);
-    if (p) {
-        hp = (struct bpmWaveformHeader *)p->payload;
-        hp->magic = BPM_PROTOCOL_MAGIC_WAVEFORM_HEADER;
-        hp->recorderNumber = rp->recorderNumber;
-        hp->waveformNumber = rp->waveformNumber;
-        hp->seconds = WR_READ(rp, WR_REG_OFFSET_TIMESTAMP_SECONDS);
-        hp->ticks = WR_READ(rp, WR_REG_OFFSET_TIMESTAMP_TICKS);
-        hp->byteCount = rp->bytesLeft = count * rp->bytesPerSample;
-        rp->commState = CS_HEADER;
-        rp->txBlock = 0;
-        rp->sysTicksAtPreviousPacket = sysTicksSinceBoot();
-        if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
-            printf("acqCount:%d(%X)  start byte offset:%d(%X)  bytesLeft:%d\n",
-                                    rp->acqCount, rp->acqCount,
-                                    rp->startByteOffset, rp->startByteOffset,
-                                    rp->bytesLeft);
+    releaseRefPbufs(rp);
+    for (i = 0 ; i < rp->refPbufCount ; i++) {
+        if (rp->refBuffer[i] == bufferIndex)
+            return 1;
     }
-    rp->bytesInPreviousPacket = 0;
-    return p;
+    return 0;
 }
 
 /*
- * Called from publisher fast-update routine
+ * Append a segment of the acquisition buffer to a packet
  */
-int
-wfrStatus(void)
+static struct pbuf *
+chainSegment(struct pbuf *p, char *base, unsigned int length)
 {
-    int i;
-    int s = 0;
+    struct pbuf *r;
 
-    for (i = BPM_PROTOCOL_RECORDER_COUNT - 1 ; i >= 0 ; i--) {
-        epicsUInt32 csr = WR_READ(&recorder[i], WR_REG_OFFSET_CSR);
-        s = (s << 1) | ((csr & WR_CSR_ARM) != 0);
+    r = pbuf_alloc(PBUF_RAW, length, PBUF_REF);
+    if (r) {
+        r->payload = base;
+        pbuf_cat(p, r);
     }
-    return s;
+    return r;
 }
 
 /*
- * Diagnostic histograms
+ * Create a packet whose payload refers to the acquisition buffer.
+ * Two segments are needed when the block wraps around the ring buffer.
  */
-#define HISTSIZE 120
-static unsigned int histogram[HISTSIZE];
+static struct pbuf *
+refPacket(struct transfer *tp, unsigned int offset, unsigned int dataLength)
+{
+    struct recorder *rp = tp->rp;
+    unsigned int l1, l2;
+    struct pbuf *p, *r;
+
+    releaseRefPbufs(rp);
+    if (rp->refPbufCount >= REF_PBUF_CAPACITY)
+        return NULL;
+    p = pbuf_alloc(PBUF_TRANSPORT, sizeof(struct bpmWaveformData) -
+                     sizeof(((struct bpmWaveformData *)0)->payload), PBUF_RAM);
+    if (p == NULL)
+        return NULL;
+    l1 = dataLength;
+    if ((offset + dataLength) > rp->acqByteCapacity)
+        l1 = rp->acqByteCapacity - offset;
+    l2 = dataLength - l1;
+    if (((r = chainSegment(p, tp->acqBuf + offset, l1)) == NULL)
+     || ((l2 != 0) && (chainSegment(p, tp->acqBuf, l2) == NULL))) {
+        pbuf_free(p);
+        return NULL;
+    }
+    pbuf_ref(r);
+    rp->refBuffer[rp->refPbufCount] = tp->xferIndex;
+    rp->refPbuf[rp->refPbufCount++] = r;
+    return p;
+}
 
 /*
- * Check that ADC waveform recorder is working as expected
+ * Create a packet containing a copy of the acquisition buffer data.
+ * Used only when no zero-copy packet can be created.
  */
-static void
-adcRecorderDiagnosticCheck(struct recorder *rp)
+static struct pbuf *
+copyPacket(struct transfer *tp, unsigned int offset, unsigned int dataLength)
 {
-    unsigned int old, new, diff;
-    int i;
-    unsigned int count = WR_READ(rp, WR_REG_OFFSET_ACQUISITION_COUNT) / 2;
-    unsigned int *a = (unsigned int *)rp->acqBuf;
-    int errorCount = 0;
+    struct recorder *rp = tp->rp;
+    struct bpmWaveformData *dp;
+    struct pbuf *p;
 
-    showRec(rp);
-    for (i = 0 ; i < HISTSIZE ; i++) histogram[i] = 0;
-    old = a[0];
-    for (i = 1 ; i < count ; i++) {
-        new = a[i*4];
-        diff = new - old;
-        if (errorCount < 100) {
-            if ((diff == 0)
-             || (diff >= HISTSIZE)
-             || ((a[i*4+1] - 1) != a[(i-1)*4+1])
-             || ((a[i*4+1] + 1) != a[(i*4+2)])
-             || ((a[i*4+1] + 2) != a[(i*4+3)])) {
-                if (errorCount == 0)
-                    printf("  Index     TICKS   ADC 1    ADC 2    ADC 3 \n");
-                printf("%7d: %8.8X %8.8X %8.8X %8.8X\n", i, a[i*4+0], a[i*4+1],
-                                                            a[i*4+2], a[i*4+3]);
-                if (++errorCount >= 100) {
-                    printf("Too many errors -- printing inhibited\n");
-                }
-            }
+    p = pbuf_alloc(PBUF_TRANSPORT,
+                   sizeof(*dp) - sizeof(dp->payload) + dataLength, PBUF_RAM);
+    if (p) {
+        dp = (struct bpmWaveformData *)p->payload;
+        if ((offset + dataLength) <= rp->acqByteCapacity) {
+            memcpy(dp->payload, tp->acqBuf + offset, dataLength);
+        }
+        else {
+            /* Handle ring buffer wraparound */
+            unsigned int l1, l2;
+            l1 = rp->acqByteCapacity - offset;
+            memcpy(dp->payload, tp->acqBuf + offset, l1);
+            offset = 0;
+            l2 = dataLength - l1;
+            memcpy(dp->payload + l1, tp->acqBuf + offset, l2);
         }
-        if (diff >= HISTSIZE) diff = HISTSIZE - 1;
-        histogram[diff]++;
-        old = new;
-    }
-    for (i = 0 ; i < HISTSIZE ; i++) {
-        if (histogram[i])
-            printf("%5d: %u\n", i, histogram[i]);
     }
+    return p;
 }
 
 /*
- * Check that non-ADC waveform recorder is working as expected
+ * Create a packet containing a compressed copy of the acquisition buffer.
+ * Return NULL if compression doesn't make the block smaller.
  */
-static void
-recorderDiagnosticCheck(struct recorder *rp)
+static struct pbuf *
+compressPacket(struct transfer *tp, unsigned int offset,
+                                    unsigned int dataLength)
 {
-    unsigned int oldVal, val, wordCount;
-    int i;
-    unsigned int count = WR_READ(rp, WR_REG_OFFSET_ACQUISITION_COUNT);
-    char *nextAddress = (char *)WR_READ(rp, WR_REG_OFFSET_ADDRESS_POINTER);
-    unsigned int bIndex = ((nextAddress - rp->acqBuf) +
-                           rp->acqByteCapacity -
-                           (count * rp->bytesPerSample)) % rp->acqByteCapacity;
+    struct recorder *rp = tp->rp;
+    struct bpmWaveformData *dp;
+    struct pbuf *p;
+    int n;
 
-    showRec(rp);
-    for (i = 0 ; i < HISTSIZE ; i++) histogram[i] = 0;
-    for (i = 0 ; i < count ; i++) {
-        int *a = (int *)(rp->acqBuf + bIndex);
-        val = a[0];
-        if (i && (val != (oldVal + 1))) {
-            printf("%7d: %8.8X %8.8X %8.8X %8.8X %8.8X\n", i, a[0], a[1],
-                                                           a[2], a[3], oldVal);
+    p = pbuf_alloc(PBUF_TRANSPORT,
+                   sizeof(*dp) - sizeof(dp->payload) + dataLength, PBUF_RAM);
+    if (p) {
+        dp = (struct bpmWaveformData *)p->payload;
+        n = wfrCompress(dp->payload, dataLength - 1,
+                        tp->acqBuf, rp->acqByteCapacity,
+                        offset, dataLength, rp->bytesPerSample);
+        if (n < 0) {
+            pbuf_free(p);
+            return NULL;
         }
-        oldVal = val;
-        bIndex = (bIndex + rp->bytesPerSample) % rp->acqByteCapacity;
-        val = a[1];
-        if (val >= HISTSIZE) val = HISTSIZE - 1;
-        histogram[val]++;
+        pbuf_realloc(p, sizeof(*dp) - sizeof(dp->payload) + n);
     }
-    printf("Burst sizes:\n");
-    for (i = HISTSIZE - 1, oldVal = 0, wordCount = 0 ; i >= 0 ; i--) {
-        int c = histogram[i] - oldVal;
-        if (c < 0) {
-            printf("histogram[%d]=%u c=%d\n", i, histogram[i], c);
-            c = 0;
+    return p;
+}
+
+/*
+ * Create a packet containing only the selected channels.
+ * Blocks need not hold whole packed samples so the first and
+ * last samples of a block may be partial.
+ */
+static struct pbuf *
+gatherPacket(struct transfer *tp, unsigned int outOffset,
+                                  unsigned int dataLength)
+{
+    struct recorder *rp = tp->rp;
+    struct bpmWaveformData *dp;
+    struct pbuf *p;
+    unsigned char sample[16], *op;
+    unsigned int channelBytes = rp->bytesPerSample / CHANNEL_COUNT;
+    unsigned int skip, offset, n;
+    int c;
+
+    p = pbuf_alloc(PBUF_TRANSPORT,
+                   sizeof(*dp) - sizeof(dp->payload) + dataLength, PBUF_RAM);
+    if (p) {
+        dp = (struct bpmWaveformData *)p->payload;
+        op = dp->payload;
+        skip = outOffset % tp->outBytesPerSample;
+        offset = (tp->startByteOffset +
+                  ((outOffset / tp->outBytesPerSample) * rp->bytesPerSample)) %
+                                                            rp->acqByteCapacity;
+        while (dataLength) {
+            const char *cp = tp->acqBuf + offset;
+            for (c = 0, n = 0 ; c < CHANNEL_COUNT ; c++) {
+                if (tp->channelMask & (1 << c)) {
+                    memcpy(sample + n, cp + (c * channelBytes), channelBytes);
+                    n += channelBytes;
+                }
+            }
+            n -= skip;
+            if (n > dataLength)
+                n = dataLength;
+            memcpy(op, sample + skip, n);
+            op += n;
+            dataLength -= n;
+            skip = 0;
+            offset += rp->bytesPerSample;
+            if (offset >= rp->acqByteCapacity)
+                offset = 0;
         }
-        oldVal += c;
-        wordCount += (i + 1) * c;
-        if (c) printf("%5d: %u\n", i + 1, c);
     }
-    printf("Words transferred: %u\n", wordCount);
+    return p;
 }
 
 /*
- * Called from publisher work-check routine
- * Hand back a pointer to the packet to be transmitted.
+ * Create a data packet
  */
-struct pbuf *
-wfrCheckForWork(void)
+static struct pbuf *
+dataPacket(struct transfer *tp, unsigned int block)
 {
-    static int recorderIndex;
-    struct recorder *rp;
+    struct recorder *rp = tp->rp;
+    unsigned int offset, dataLength;
+    struct bpmWaveformData *dp;
     struct pbuf *p = NULL;
-    uint32_t now;
+    epicsUInt32 magic = BPM_PROTOCOL_MAGIC_WAVEFORM_DATA;
+    const char *how = " (copied)";
+    uint32_t then;
 
-    /*
-     * Rotate through recorders one at a time
-     */
-    if (recorderIndex >= (BPM_PROTOCOL_RECORDER_COUNT - 1))
-        recorderIndex = 0;
-    else
-        recorderIndex++;
-    rp = recorderPointer(recorderIndex);
+    if (block >= tp->blockCount)
+        return NULL;
+    then = sysTicksSinceBoot();
+    offset = block * tp->blockSize;
+    dataLength = tp->byteCount - offset;
+    if (dataLength > tp->blockSize)
+        dataLength = tp->blockSize;
 
     /*
-     * Send a header when a recorder has filled
+     * Create the packet
      */
-    if (rp->commState == CS_IDLE) {
-        epicsUInt32 csr = WR_READ(rp, WR_REG_OFFSET_CSR);
-        if (csr & WR_CSR_IS_FULL) {
-            /* Clear full status */
-            wrWrite(rp, WR_REG_OFFSET_CSR, rp->csrModeBits);
-            if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
-                printf("Recorder %d is full\n", rp->recorderNumber);
+    if (tp->channelMask != ALL_CHANNELS) {
+        p = gatherPacket(tp, offset, dataLength);
+    }
+    else {
+        offset = (tp->startByteOffset + offset) % rp->acqByteCapacity;
+        if (tp->isCompressed) {
+            p = compressPacket(tp, offset, dataLength);
+            if (p) {
+                magic = BPM_PROTOCOL_MAGIC_WAVEFORM_COMPRESSED_DATA;
+                rp->blocksCompressed++;
+                how = " (compressed)";
+            }
+        }
+        if ((p == NULL) && ((p = refPacket(tp, offset, dataLength)) != NULL))
+            how = "";
+        if (p == NULL)
+            p = copyPacket(tp, offset, dataLength);
+    }
+    if (p) {
+        dp = (struct bpmWaveformData *)p->payload;
+        dp->magic = magic;
+        dp->recorderNumber = rp->recorderNumber;
+        dp->waveformNumber = tp->waveformNumber;
+        dp->blockNumber = block;
+        rp->packetsSent++;
+        rp->bytesSent += p->tot_len - (sizeof(*dp) - sizeof(dp->payload));
+        tp->sysTicksAtPreviousPacket = sysTicksSinceBoot();
+        if (debugFlags & DEBUGFLAG_WAVEFORM_XFER)
+            printf("WFR %d block %d size %d%s\n", rp->recorderNumber,
+                                              (int)dp->blockNumber,
+                                              (int)(p->tot_len - (sizeof(*dp) -
+                                                       sizeof(dp->payload))),
+                                              how);
+    }
+    profileEnd(PROFILE_WFR_DATA, then);
+    return p;
+}
+
+/*
+ * Create the data packet for the block awaiting acknowledgement
+ * from an IOC using the stop-and-wait protocol.
+ */
+static struct pbuf *
+lockstepPacket(struct transfer *tp)
+{
+    struct recorder *rp = tp->rp;
+    struct pbuf *p = dataPacket(tp, tp->txBlock);
+
+    if (p) {
+        tp->commState = CS_ACTIVE;
+    }
+    else {
+        if (tp->txBlock >= tp->blockCount)
+            rp->transfersCompleted++;
+        tp->commState = CS_IDLE;
+    }
+    return p;
+}
+
+/*
+ * Windowed transfer helpers
+ */
+static int
+isSacked(struct transfer *tp, unsigned int block)
+{
+    unsigned int i;
+
+    if (block <= tp->ackBlock)
+        return 0;
+    i = block - tp->ackBlock - 1;
+    if (i >= BPM_PROTOCOL_WAVEFORM_WINDOW_CAPACITY)
+        return 0;
+    return (tp->sack[i / 32] & (1UL << (i % 32))) != 0;
+}
+
+/*
+ * Create the next packet of a windowed transfer.
+ * Holes reported by the IOC take precedence over blocks never yet sent.
+ */
+static struct pbuf *
+windowPacket(struct transfer *tp)
+{
+    struct recorder *rp = tp->rp;
+    struct pbuf *p;
+
+    while (tp->retxBlock < tp->retxLimit) {
+        if ((tp->retxBlock >= tp->ackBlock) && !isSacked(tp, tp->retxBlock)) {
+            p = dataPacket(tp, tp->retxBlock);
+            if (p) {
+                if (debugFlags & DEBUGFLAG_WAVEFORM_XFER)
+                    printf("WFR %d resend %d\n", rp->recorderNumber,
+                                                  tp->retxBlock);
+                rp->blocksResent++;
+                tp->retxBlock++;
+            }
+            return p;
+        }
+        tp->retxBlock++;
+    }
+    if ((tp->txBlock < tp->blockCount)
+     && ((tp->txBlock - tp->ackBlock) < tp->windowSize)) {
+        p = dataPacket(tp, tp->txBlock);
+        if (p)
+            tp->txBlock++;
+        return p;
+    }
+    return NULL;
+}
+
+/*
+ * Capture state follows from the subscribers yet to be sent it
+ * and the number of transfers still reading from it.
+ */
+static void
+captureUpdate(struct capture *cp)
+{
+    if ((cp->state == CAP_FREE)
+     || (cp->state == CAP_FILLING)
+     || (cp->state == CAP_PACKING))
+        return;
+    cp->state = cp->activeCount ? CAP_DRAINING :
+                cp->unsentMask  ? CAP_QUEUED   : CAP_DONE;
+}
+
+/*
+ * Let go of the capture a transfer was sending
+ */
+static void
+transferRelease(struct transfer *tp)
+{
+    struct capture *cp;
+
+    if (tp->xferIndex < 0)
+        return;
+    cp = &tp->rp->capture[tp->xferIndex];
+    if (cp->activeCount)
+        cp->activeCount--;
+    captureUpdate(cp);
+    tp->xferIndex = -1;
+}
+
+/*
+ * Convert subscriber and recorder index to transfer pointer
+ */
+static struct transfer *
+transferPointer(int subscriber, int recorderIndex)
+{
+    struct recorder *rp = recorderPointer(recorderIndex);
+
+    if ((rp == NULL)
+     || (subscriber < 0)
+     || (subscriber >= PUBLISHER_SUBSCRIBER_CAPACITY)
+     || !(subscriberMask & (1 << subscriber)))
+        return NULL;
+    return &rp->xfer[subscriber];
+}
+
+/*
+ * Called from publisher packet handler.
+ * Hand back a pointer to the data packet to be transmitted.
+ */
+struct pbuf *
+wfrAckPacket(int subscriber, struct bpmWaveformAck *ackp)
+{
+    struct transfer *tp = transferPointer(subscriber, ackp->recorderNumber);
+
+    /*
+     * Sanity check
+     */
+    if ((tp == NULL)
+     || ((tp->commState != CS_ACTIVE) && (tp->commState != CS_HEADER))
+     || tp->isWindowed
+     || (ackp->magic != BPM_PROTOCOL_MAGIC_WAVEFORM_ACK)
+     || (ackp->waveformNumber != tp->waveformNumber)
+     || (ackp->blockNumber != tp->txBlock))
+        return NULL;
+    if (debugFlags & DEBUGFLAG_WAVEFORM_XFER)
+        printf("WFR %d ACK %d\n", (int)ackp->recorderNumber,
+                                  (int)ackp->blockNumber);
+
+    /*
+     * Determine contents
+     */
+    tp->retryCount = 0;
+    if (tp->commState != CS_HEADER)
+        tp->txBlock++;
+    releaseTxPbufs();
+    return txTrack(lockstepPacket(tp));
+}
+
+/*
+ * Called from publisher packet handler.
+ * Update windowed transfer state and hand back a pointer to the
+ * first data packet to be transmitted.  Subsequent packets are
+ * sent from the publisher work-check routine.
+ */
+struct pbuf *
+wfrWindowAckPacket(int subscriber, struct bpmWaveformWindowAck *ackp)
+{
+    struct transfer *tp = transferPointer(subscriber, ackp->recorderNumber);
+    unsigned int i, highestSacked;
+
+    /*
+     * Sanity check
+     */
+    if ((tp == NULL)
+     || (ackp->magic != BPM_PROTOCOL_MAGIC_WAVEFORM_WINDOW_ACK)
+     || (ackp->waveformNumber != tp->waveformNumber))
+        return NULL;
+    if (tp->commState == CS_HEADER) {
+        if (ackp->blockNumber != 0)
+            return NULL;
+        tp->isWindowed = 1;
+        tp->commState = CS_ACTIVE;
+        tp->ackBlock = 0;
+        tp->retxBlock = tp->retxLimit = 0;
+    }
+    else if ((tp->commState != CS_ACTIVE)
+          || !tp->isWindowed
+          || (ackp->blockNumber < tp->ackBlock)
+          || (ackp->blockNumber > tp->txBlock)) {
+        return NULL;
+    }
+    if (debugFlags & DEBUGFLAG_WAVEFORM_XFER)
+        printf("WFR %d WACK %d %08X\n", (int)ackp->recorderNumber,
+                                        (int)ackp->blockNumber,
+                                        (unsigned int)ackp->sack[0]);
+    tp->retryCount = 0;
+    tp->sysTicksAtPreviousPacket = sysTicksSinceBoot();
+    tp->windowSize = ackp->windowSize;
+    if (tp->windowSize < 1)
+        tp->windowSize = 1;
+    if (tp->windowSize > BPM_PROTOCOL_WAVEFORM_WINDOW_CAPACITY)
+        tp->windowSize = BPM_PROTOCOL_WAVEFORM_WINDOW_CAPACITY;
+    tp->ackBlock = ackp->blockNumber;
+    memcpy(tp->sack, ackp->sack, sizeof tp->sack);
+    if (tp->ackBlock >= tp->blockCount) {
+        tp->rp->transfersCompleted++;
+        tp->commState = CS_IDLE;
+        return NULL;
+    }
+
+    /*
+     * Resend holes below the highest block received, but only
+     * those that haven't already been resent.  Repeated losses
+     * are recovered by the timeout.
+     */
+    highestSacked = 0;
+    for (i = BPM_PROTOCOL_WAVEFORM_WINDOW_CAPACITY ; i > 0 ; i--) {
+        if (tp->sack[(i - 1) / 32] & (1UL << ((i - 1) % 32))) {
+            highestSacked = tp->ackBlock + i;
+            break;
+        }
+    }
+    if (highestSacked > tp->retxLimit) {
+        if (tp->retxLimit > tp->ackBlock)
+            tp->retxBlock = tp->retxLimit;
+        else
+            tp->retxBlock = tp->ackBlock;
+        tp->retxLimit = highestSacked;
+    }
+    releaseTxPbufs();
+    return txTrack(windowPacket(tp));
+}
+
+/*
+ * Find the start of the acquired data and return the number of samples
+ */
+static unsigned int
+captureLocate(struct recorder *rp, struct capture *cp,
+              unsigned int *startByteOffset)
+{
+    unsigned int count;
+
+    count = cp->count;
+    if (count > rp->acqSampleCapacity)
+        count = rp->acqSampleCapacity;
+    if (rp->recorderNumber == 0) {
+        /*
+         * ADC recorder uses linear buffer with fixed trigger samples.
+         */
+        *startByteOffset = (ADC_WFR_HW_PRETRIG_COUNT - cp->pretrigCount) *
+                                                            rp->bytesPerSample;
+    }
+    else {
+        /* Other recorders use a ring buffer */
+        *startByteOffset = ((cp->nextAddress - cp->base) +
+                            rp->acqByteCapacity -
+                            (count * rp->bytesPerSample)) %
+                                                            rp->acqByteCapacity;
+    }
+    return count;
+}
+
+static unsigned int
+locateCapture(struct transfer *tp)
+{
+    struct recorder *rp = tp->rp;
+
+    return captureLocate(rp, &rp->capture[tp->xferIndex],
+                                                    &tp->startByteOffset);
+}
+
+/*
+ * Prepare to compute envelope of newly-acquired waveform
+ */
+static void
+envelopeStart(struct recorder *rp, struct capture *cp)
+{
+    unsigned int count = captureLocate(rp, cp, &cp->envStartByteOffset);
+    unsigned int points = rp->envelopePointCount;
+    int c;
+
+    if (points > count)
+        points = count;
+    cp->envSampleCount = count;
+    if (points) {
+        cp->envSamplesPerPoint = (count + points - 1) / points;
+        cp->envPointCount = (count + cp->envSamplesPerPoint - 1) /
+                                                        cp->envSamplesPerPoint;
+    }
+    else {
+        cp->envSamplesPerPoint = 0;
+        cp->envPointCount = 0;
+    }
+    cp->envPointIndex = 0;
+    cp->envSampleIndex = 0;
+    for (c = 0 ; c < BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT ; c++) {
+        cp->envMin[c] = 0x7FFFFFFF;
+        cp->envMax[c] = -0x7FFFFFFF - 1;
+        cp->envSum[c] = 0;
+    }
+}
+
+/*
+ * Accumulate a run of samples into the current envelope point
+ */
+static void
+envelopeAccumulate(struct recorder *rp, struct capture *cp,
+                   unsigned int first, unsigned int n)
+{
+    unsigned int offset;
+    int c;
+
+    offset = (cp->envStartByteOffset + (first * rp->bytesPerSample)) %
+                                                            rp->acqByteCapacity;
+    while (n--) {
+        const char *sp = cp->base + offset;
+        for (c = 0 ; c < BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT ; c++) {
+            epicsInt32 v;
+            if (rp->bytesPerSample == 8)
+                v = ((const epicsInt16 *)sp)[c];
+            else
+                v = ((const epicsInt32 *)sp)[c];
+            if (v < cp->envMin[c]) cp->envMin[c] = v;
+            if (v > cp->envMax[c]) cp->envMax[c] = v;
+            cp->envSum[c] += v;
+        }
+        offset += rp->bytesPerSample;
+        if (offset >= rp->acqByteCapacity)
+            offset = 0;
+    }
+}
+
+/*
+ * Work on the current envelope point
+ * Return the number of samples processed.
+ */
+static unsigned int
+envelopeStep(struct recorder *rp, struct capture *cp, unsigned int budget)
+{
+    unsigned int first = cp->envPointIndex * cp->envSamplesPerPoint;
+    unsigned int limit = first + cp->envSamplesPerPoint;
+    unsigned int n;
+    int c;
+
+    if (limit > cp->envSampleCount)
+        limit = cp->envSampleCount;
+    first += cp->envSampleIndex;
+    n = limit - first;
+    if (n > budget)
+        n = budget;
+    envelopeAccumulate(rp, cp, first, n);
+    cp->envSampleIndex += n;
+    if ((first + n) == limit) {
+        struct bpmEnvelopePoint *pp = cp->envPoint[cp->envPointIndex];
+        for (c = 0 ; c < BPM_PROTOCOL_ENVELOPE_CHANNEL_COUNT ; c++) {
+            pp[c].min = cp->envMin[c];
+            pp[c].max = cp->envMax[c];
+            pp[c].mean = cp->envSum[c] / (int)cp->envSampleIndex;
+            cp->envMin[c] = 0x7FFFFFFF;
+            cp->envMax[c] = -0x7FFFFFFF - 1;
+            cp->envSum[c] = 0;
+        }
+        cp->envPointIndex++;
+        cp->envSampleIndex = 0;
+    }
+    return n;
+}
+
+/*
+ * Compute more of the envelope of a capture waiting to be sent
+ */
+static void
+envelopeCheckForWork(struct recorder *rp, struct capture *cp)
+{
+    unsigned int budget = ENVELOPE_SAMPLES_PER_PASS;
+    uint32_t then;
+
+    if (((cp->state != CAP_QUEUED) && (cp->state != CAP_DRAINING))
+     || (cp->envPointIndex >= cp->envPointCount))
+        return;
+    then = sysTicksSinceBoot();
+    while ((budget != 0) && (cp->envPointIndex < cp->envPointCount))
+        budget -= envelopeStep(rp, cp, budget);
+    profileEnd(PROFILE_WFR_ENVELOPE, then);
+}
+
+/*
+ * Hand back a packet of envelope points once enough are ready,
+ * otherwise NULL.
+ */
+static struct pbuf *
+envelopePacket(struct transfer *tp)
+{
+    struct recorder *rp = tp->rp;
+    struct capture *cp = &rp->capture[tp->xferIndex];
+    unsigned int ready = cp->envPointIndex - tp->envFirstPoint;
+    struct pbuf *p;
+    struct bpmWaveformEnvelope *ep;
+
+    if (ready > BPM_PROTOCOL_ENVELOPE_POINTS_PER_PACKET)
+        ready = BPM_PROTOCOL_ENVELOPE_POINTS_PER_PACKET;
+    if ((ready == 0)
+     || ((ready < BPM_PROTOCOL_ENVELOPE_POINTS_PER_PACKET)
+      && (cp->envPointIndex < cp->envPointCount)))
+        return NULL;
+    p = pbuf_alloc(PBUF_TRANSPORT, sizeof(*ep) - sizeof(ep->point) +
+                                   ready * sizeof(ep->point[0]), PBUF_RAM);
+    if (p) {
+        ep = (struct bpmWaveformEnvelope *)p->payload;
+        ep->magic = BPM_PROTOCOL_MAGIC_WAVEFORM_ENVELOPE;
+        ep->waveformNumber = tp->waveformNumber;
+        ep->recorderNumber = rp->recorderNumber;
+        ep->pointCount = ready;
+        ep->firstPoint = tp->envFirstPoint;
+        ep->totalPoints = cp->envPointCount;
+        ep->samplesPerPoint = cp->envSamplesPerPoint;
+        ep->seconds = cp->seconds;
+        ep->ticks = cp->ticks;
+        memcpy(ep->point, cp->envPoint[tp->envFirstPoint],
+                                            ready * sizeof(ep->point[0]));
+        tp->envFirstPoint += ready;
+        if (debugFlags & DEBUGFLAG_WAVEFORM_XFER)
+            printf("WFR %d envelope %d of %d\n", rp->recorderNumber,
+                                                  tp->envFirstPoint,
+                                                  cp->envPointCount);
+    }
+    return p;
+}
+
+/*
+ * Create a header packet
+ */
+static struct pbuf *
+headerPacket(struct transfer *tp)
+{
+    struct recorder *rp = tp->rp;
+    struct pbuf *p;
+    struct bpmWaveformHeader *hp;
+    struct bpmWaveformRoiHeader *rhp;
+    struct bpmWaveformSegmentHeader *shp;
+    struct capture *cp = &rp->capture[tp->xferIndex];
+    unsigned int count, first = 0, size = sizeof(*hp);
+    int isSegmented = !tp->isRoi && (cp->segmentCount > 1);
+    int c;
+    uint32_t then = sysTicksSinceBoot();
+
+    if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+        showRec(rp);
+    count = locateCapture(tp);
+    tp->channelMask = ALL_CHANNELS;
+    tp->outBytesPerSample = rp->bytesPerSample;
+    if (tp->isRoi) {
+        first = rp->roiFirstSample;
+        if (first > count)
+            first = count;
+        count -= first;
+        if (count > rp->roiSampleCount)
+            count = rp->roiSampleCount;
+        tp->startByteOffset = (tp->startByteOffset +
+                               (first * rp->bytesPerSample)) %
+                                                            rp->acqByteCapacity;
+        tp->channelMask = rp->roiChannelMask;
+        tp->outBytesPerSample = 0;
+        for (c = 0 ; c < CHANNEL_COUNT ; c++) {
+            if (tp->channelMask & (1 << c))
+                tp->outBytesPerSample += rp->bytesPerSample / CHANNEL_COUNT;
+        }
+    }
+    if (tp->isRoi)
+        size = sizeof(*rhp);
+    else if (isSegmented)
+        size = sizeof(*shp);
+    p = pbuf_alloc(PBUF_TRANSPORT, size, PBUF_RAM);
+    if (p) {
+        hp = (struct bpmWaveformHeader *)p->payload;
+        if (tp->isRoi) {
+            rhp = (struct bpmWaveformRoiHeader *)p->payload;
+            rhp->firstSample = first;
+            rhp->sampleCount = count;
+            rhp->channelMask = tp->channelMask;
+        }
+        else if (isSegmented) {
+            shp = (struct bpmWaveformSegmentHeader *)p->payload;
+            memset(shp->segment, 0, sizeof shp->segment);
+            shp->segmentCount = cp->segmentCount;
+            shp->samplesPerSegment = cp->samplesPerSegment;
+            for (c = 0 ; c < cp->segmentCount ; c++) {
+                shp->segment[c].seconds = cp->segmentSeconds[c];
+                shp->segment[c].ticks = cp->segmentTicks[c];
+            }
+        }
+        hp->magic = BPM_PROTOCOL_MAGIC_WAVEFORM_HEADER;
+        hp->recorderNumber = rp->recorderNumber;
+        tp->blockSize = subscription[tp->subscriber].payloadCapacity;
+        tp->isCompressed =
+               ((subscription[tp->subscriber].options &
+                                    BPM_PROTOCOL_SUBSCRIBE_WAVEFORM_COMPRESSION)
+             && (tp->channelMask == ALL_CHANNELS));
+        hp->blockSize = tp->blockSize;
+        if (tp->isCompressed)
+            hp->blockSize |= BPM_PROTOCOL_WAVEFORM_BLOCK_COMPRESSED;
+        hp->waveformNumber = tp->waveformNumber;
+        hp->seconds = cp->seconds;
+        hp->ticks = cp->ticks;
+        hp->byteCount = tp->byteCount = count * tp->outBytesPerSample;
+        tp->blockCount = (tp->byteCount + tp->blockSize - 1) / tp->blockSize;
+        tp->commState = CS_HEADER;
+        tp->isWindowed = 0;
+        tp->txBlock = 0;
+        tp->sysTicksAtPreviousPacket = sysTicksSinceBoot();
+        if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+            printf("acqCount:%d(%X)  start byte offset:%d(%X)  byteCount:%d"
+                                                        "  blockSize:%d\n",
+                                    rp->acqCount, rp->acqCount,
+                                    tp->startByteOffset, tp->startByteOffset,
+                                    tp->byteCount, tp->blockSize);
+    }
+    profileEnd(PROFILE_WFR_HEADER, then);
+    return p;
+}
+
+/*
+ * Called from publisher packet handler when a subscription arrives.
+ * Takes effect with the next waveform header.
+ * Keep blocks a multiple of 16 bytes so they always hold whole samples.
+ */
+void
+wfrSetSubscription(int subscriber, unsigned int capacity, unsigned int options)
+{
+    struct subscription *sp;
+
+    if ((subscriber < 0) || (subscriber >= PUBLISHER_SUBSCRIBER_CAPACITY))
+        return;
+    sp = &subscription[subscriber];
+    subscriberMask |= 1 << subscriber;
+    sp->options = options;
+    if (capacity == 0)
+        capacity = BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY;
+    else if (capacity > BPM_PROTOCOL_WAVEFORM_MAX_PAYLOAD_CAPACITY)
+        capacity = BPM_PROTOCOL_WAVEFORM_MAX_PAYLOAD_CAPACITY;
+    capacity &= ~0xF;
+    if (capacity == 0)
+        capacity = 16;
+    if ((capacity != sp->payloadCapacity) && (debugFlags & DEBUGFLAG_PUBLISHER))
+        printf("Subscriber %d waveform block size %d\n", subscriber, capacity);
+    sp->payloadCapacity = capacity;
+}
+
+/*
+ * Called from publisher when a subscriber goes away.
+ * Abandon transfers to that subscriber and forget
+ * acquisitions waiting to be sent to it.
+ */
+void
+wfrUnsubscribe(int subscriber)
+{
+    int i, b;
+
+    if ((subscriber < 0) || (subscriber >= PUBLISHER_SUBSCRIBER_CAPACITY))
+        return;
+    subscriberMask &= ~(1 << subscriber);
+    for (i = 0 ; i < BPM_PROTOCOL_RECORDER_COUNT ; i++) {
+        struct recorder *rp = &recorder[i];
+        struct transfer *tp = &rp->xfer[subscriber];
+        tp->commState = CS_IDLE;
+        tp->roiPending = 0;
+        transferRelease(tp);
+        for (b = 0 ; b < BUFFERS_PER_RECORDER ; b++) {
+            rp->capture[b].unsentMask &= ~(1 << subscriber);
+            captureUpdate(&rp->capture[b]);
+        }
+    }
+}
+
+/*
+ * Smallest block size requested by any subscriber
+ */
+static unsigned int
+minimumPayloadCapacity(void)
+{
+    unsigned int s, capacity = BPM_PROTOCOL_WAVEFORM_MAX_PAYLOAD_CAPACITY;
+
+    if (subscriberMask == 0)
+        return BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY;
+    for (s = 0 ; s < PUBLISHER_SUBSCRIBER_CAPACITY ; s++) {
+        if ((subscriberMask & (1 << s))
+         && (subscription[s].payloadCapacity < capacity))
+            capacity = subscription[s].payloadCapacity;
+    }
+    return capacity;
+}
+
+/*
+ * Called from publisher fast-update routine
+ */
+int
+wfrStatus(void)
+{
+    int i;
+    int s = 0;
+
+    for (i = BPM_PROTOCOL_RECORDER_COUNT - 1 ; i >= 0 ; i--) {
+        epicsUInt32 csr = WR_READ(&recorder[i], WR_REG_OFFSET_CSR);
+        s = (s << 1) | ((csr & WR_CSR_ARM) != 0);
+    }
+    return s;
+}
+
+/*
+ * Diagnostic histograms
+ */
+#define HISTSIZE 120
+static unsigned int histogram[HISTSIZE];
+
+/*
+ * Check that ADC waveform recorder is working as expected
+ */
+static void
+adcRecorderDiagnosticCheck(struct recorder *rp, struct capture *cp)
+{
+    unsigned int old, new, diff;
+    int i;
+    unsigned int count = cp->count / 2;
+    unsigned int *a = (unsigned int *)cp->base;
+    int errorCount = 0;
+
+    showRec(rp);
+    for (i = 0 ; i < HISTSIZE ; i++) histogram[i] = 0;
+    old = a[0];
+    for (i = 1 ; i < count ; i++) {
+        new = a[i*4];
+        diff = new - old;
+        if (errorCount < 100) {
+            if ((diff == 0)
+             || (diff >= HISTSIZE)
+             || ((a[i*4+1] - 1) != a[(i-1)*4+1])
+             || ((a[i*4+1] + 1) != a[(i*4+2)])
+             || ((a[i*4+1] + 2) != a[(i*4+3)])) {
+                if (errorCount == 0)
+                    printf("  Index     TICKS   ADC 1    ADC 2    ADC 3 \n");
+                printf("%7d: %8.8X %8.8X %8.8X %8.8X\n", i, a[i*4+0], a[i*4+1],
+                                                            a[i*4+2], a[i*4+3]);
+                if (++errorCount >= 100) {
+                    printf("Too many errors -- printing inhibited\n");
+                }
+            }
+        }
+        if (diff >= HISTSIZE) diff = HISTSIZE - 1;
+        histogram[diff]++;
+        old = new;
+    }
+    for (i = 0 ; i < HISTSIZE ; i++) {
+        if (histogram[i])
+            printf("%5d: %u\n", i, histogram[i]);
+    }
+}
+
+/*
+ * Check that non-ADC waveform recorder is working as expected
+ */
+static void
+recorderDiagnosticCheck(struct recorder *rp, struct capture *cp)
+{
+    unsigned int oldVal, val, wordCount;
+    int i;
+    unsigned int count = cp->count;
+    unsigned int bIndex = ((cp->nextAddress - cp->base) +
+                           rp->acqByteCapacity -
+                           (count * rp->bytesPerSample)) % rp->acqByteCapacity;
+
+    showRec(rp);
+    for (i = 0 ; i < HISTSIZE ; i++) histogram[i] = 0;
+    for (i = 0 ; i < count ; i++) {
+        int *a = (int *)(cp->base + bIndex);
+        val = a[0];
+        if (i && (val != (oldVal + 1))) {
+            printf("%7d: %8.8X %8.8X %8.8X %8.8X %8.8X\n", i, a[0], a[1],
+                                                           a[2], a[3], oldVal);
+        }
+        oldVal = val;
+        bIndex = (bIndex + rp->bytesPerSample) % rp->acqByteCapacity;
+        val = a[1];
+        if (val >= HISTSIZE) val = HISTSIZE - 1;
+        histogram[val]++;
+    }
+    printf("Burst sizes:\n");
+    for (i = HISTSIZE - 1, oldVal = 0, wordCount = 0 ; i >= 0 ; i--) {
+        int c = histogram[i] - oldVal;
+        if (c < 0) {
+            printf("histogram[%d]=%u c=%d\n", i, histogram[i], c);
+            c = 0;
+        }
+        oldVal += c;
+        wordCount += (i + 1) * c;
+        if (c) printf("%5d: %u\n", i + 1, c);
+    }
+    printf("Words transferred: %u\n", wordCount);
+}
+
+/*
+ * Make a capture available for sending
+ */
+static void
+captureReady(struct recorder *rp, struct capture *cp)
+{
+    int s;
+
+    cp->state = CAP_QUEUED;
+    cp->unsentMask = subscriberMask;
+    cp->activeCount = 0;
+    captureUpdate(cp);
+    envelopeStart(rp, cp);
+    rp->latestIndex = cp - rp->capture;
+    for (s = 0 ; s < PUBLISHER_SUBSCRIBER_CAPACITY ; s++)
+        rp->xfer[s].roiPending = 0;
+    if (cp->isDiagnostic) {
+        if (rp->recorderNumber == 0)
+            adcRecorderDiagnosticCheck(rp, cp);
+        else
+            recorderDiagnosticCheck(rp, cp);
+    }
+}
+
+/*
+ * Index within its region of the first sample of a segment
+ */
+static unsigned int
+segmentFirst(struct recorder *rp, struct capture *cp, unsigned int segment)
+{
+    unsigned int stride = 1U << cp->segmentShift;
+    unsigned int end = ((cp->segmentEnd[segment] - cp->base) /
+                                            rp->bytesPerSample) & (stride - 1);
+
+    return (end + stride - cp->samplesPerSegment) & (stride - 1);
+}
+
+/*
+ * Reverse the order of a run of samples a piece at a time
+ */
+static void
+reverseStart(struct capture *cp, char *base, unsigned int count,
+             unsigned int bytesPerSample)
+{
+    cp->packLo = base;
+    cp->packHi = count ? base + ((count - 1) * bytesPerSample) : base;
+}
+
+static unsigned int
+reverseSome(struct capture *cp, unsigned int bytesPerSample,
+            unsigned int budget)
+{
+    char t[16];
+    unsigned int done = 0;
+
+    while ((cp->packLo < cp->packHi) && (done < budget)) {
+        memcpy(t, cp->packLo, bytesPerSample);
+        memcpy(cp->packLo, cp->packHi, bytesPerSample);
+        memcpy(cp->packHi, t, bytesPerSample);
+        cp->packLo += bytesPerSample;
+        cp->packHi -= bytesPerSample;
+        done += 2 * bytesPerSample;
+    }
+    return done;
+}
+
+/*
+ * Move the segments of a segmented acquisition to follow one another
+ * so that the acquisition can then be sent just like any other.
+ * Each segment is a ring buffer in its own region.  If a segment wraps
+ * around its region rotate the region, by three reversals, so the
+ * segment starts at the beginning.  Regions are at least as large as
+ * segments and are visited in order so a segment never overwrites one
+ * yet to be moved.  Regions can be large so the work is spread across
+ * passes to avoid holding up other network traffic.
+ */
+static void
+packCheckForWork(struct recorder *rp, struct capture *cp)
+{
+    unsigned int bps = rp->bytesPerSample;
+    unsigned int stride = 1U << cp->segmentShift;
+    unsigned int n = cp->samplesPerSegment;
+    unsigned int budget = PACK_BYTES_PER_PASS;
+    unsigned int first, l;
+    char *region;
+
+    while (budget) {
+        if (cp->packSegment >= cp->segmentCount) {
+            Xil_DCacheFlush();
+            if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+                printf("Recorder %d packed %u segments\n", rp->recorderNumber,
+                                                            cp->segmentCount);
+            captureReady(rp, cp);
+            return;
+        }
+        region = cp->base + ((cp->packSegment << cp->segmentShift) * bps);
+        first = segmentFirst(rp, cp, cp->packSegment);
+        l = 0;
+        switch (cp->packStep) {
+        case PACK_START:
+            if ((first + n) > stride) {
+                reverseStart(cp, region, first, bps);
+                cp->packStep = PACK_REVERSE_HEAD;
+                break;
+            }
+            cp->packLo = region + (first * bps);
+            cp->packHi = cp->packLo + (n * bps);
+            cp->packDst = cp->base + (cp->packSegment * n * bps);
+            cp->packStep = PACK_MOVE;
+            break;
+
+        case PACK_REVERSE_HEAD:
+            if ((l = reverseSome(cp, bps, budget)) == 0) {
+                reverseStart(cp, region + (first * bps), stride - first, bps);
+                cp->packStep = PACK_REVERSE_TAIL;
+            }
+            break;
+
+        case PACK_REVERSE_TAIL:
+            if ((l = reverseSome(cp, bps, budget)) == 0) {
+                reverseStart(cp, region, stride, bps);
+                cp->packStep = PACK_REVERSE_REGION;
+            }
+            break;
+
+        case PACK_REVERSE_REGION:
+            if ((l = reverseSome(cp, bps, budget)) == 0) {
+                cp->packLo = region;
+                cp->packHi = region + (n * bps);
+                cp->packDst = cp->base + (cp->packSegment * n * bps);
+                cp->packStep = PACK_MOVE;
+            }
+            break;
+
+        case PACK_MOVE:
+            l = cp->packHi - cp->packLo;
+            if (l > budget)
+                l = budget;
+            memmove(cp->packDst, cp->packLo, l);
+            cp->packDst += l;
+            cp->packLo += l;
+            if (cp->packLo == cp->packHi) {
+                cp->packSegment++;
+                cp->packStep = PACK_START;
+            }
+            break;
+        }
+        budget = (l >= budget) ? 0 : budget - l;
+    }
+}
+
+/*
+ * Record details of a newly filled buffer
+ */
+static void
+latchCapture(struct recorder *rp)
+{
+    struct capture *cp = &rp->capture[rp->fillIndex];
+    epicsUInt32 csr = WR_READ(rp, WR_REG_OFFSET_CSR);
+
+    if (!(csr & WR_CSR_IS_FULL))
+        return;
+
+    /* Clear full status */
+    wrWrite(rp, WR_REG_OFFSET_CSR, rp->csrModeBits);
+    if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+        printf("Recorder %d buffer %d is full\n", rp->recorderNumber,
+                                                             rp->fillIndex);
 
+    /*
+     * The buffer is almost certainly bigger than the cache
+     * so it's fine to simply invalidate everything.
+     * After discussions with Xilinx and much testing I've
+     * confirmed that this is in fact the correct call.
+     * A call to 'Invalidate' seems to result in a mangled
+     * system.  This is likely because the cache is write-back.
+     */
+    Xil_DCacheFlush();
+    cp->count = WR_READ(rp, WR_REG_OFFSET_ACQUISITION_COUNT);
+    cp->nextAddress = (char *)WR_READ(rp, WR_REG_OFFSET_ADDRESS_POINTER);
+    cp->seconds = WR_READ(rp, WR_REG_OFFSET_TIMESTAMP_SECONDS);
+    cp->ticks = WR_READ(rp, WR_REG_OFFSET_TIMESTAMP_TICKS);
+    cp->isDiagnostic = ((csr & WR_CSR_DIAGNOSTIC_MODE) != 0);
+    if (cp->segmentCount > 1) {
+        unsigned int s;
+        for (s = 0 ; s < cp->segmentCount ; s++) {
+            wrWrite(rp, WR_REG_OFFSET_SEGMENT_SELECT, WR_SEGMENT_SELECT | s);
+            cp->segmentSeconds[s] = WR_READ(rp,WR_REG_OFFSET_TIMESTAMP_SECONDS);
+            cp->segmentTicks[s] = WR_READ(rp, WR_REG_OFFSET_TIMESTAMP_TICKS);
+            cp->segmentEnd[s] =
+                           (char *)WR_READ(rp, WR_REG_OFFSET_ADDRESS_POINTER);
+        }
+        wrWrite(rp, WR_REG_OFFSET_SEGMENT_SELECT, 0);
+        cp->count = cp->segmentCount * cp->samplesPerSegment;
+        cp->nextAddress = cp->base + (cp->count * rp->bytesPerSample);
+        cp->state = CAP_PACKING;
+        cp->packSegment = 0;
+        cp->packStep = PACK_START;
+        return;
+    }
+    captureReady(rp, cp);
+}
+
+/*
+ * Pick the buffer for the next acquisition.
+ * Never one being sent.  Prefer one with nothing of interest,
+ * then one already sent but not needed for a region of interest,
+ * and only as a last resort one that hasn't been sent to every
+ * subscriber yet.
+ */
+static int
+chooseBuffer(struct recorder *rp)
+{
+    int b, rank, best = -1, bestRank = 0;
+
+    for (b = 0 ; b < BUFFERS_PER_RECORDER ; b++) {
+        struct capture *cp = &rp->capture[b];
+        switch (cp->state) {
+        case CAP_FREE:
+        case CAP_FILLING:   rank = 4;                                  break;
+        case CAP_DONE:      rank = (b == rp->latestIndex) ? 2 : 3;     break;
+        case CAP_QUEUED:    rank = 1;                                  break;
+        default:            rank = 0;                                  break;
+        }
+        if ((rank > bestRank)
+         || ((rank != 0) && (rank == bestRank)
+          && ((int)(cp->waveformNumber -
+                    rp->capture[best].waveformNumber) < 0))) {
+            best = b;
+            bestRank = rank;
+        }
+    }
+    return best;
+}
+
+/*
+ * Write control/status register, setting up acquisition when arming.
+ * Returns 0 if arming has to wait for a buffer to be free of
+ * transfers in progress and of packets the network driver has
+ * yet to release.
+ */
+static int
+writeCSR(struct recorder *rp, epicsUInt32 csr)
+{
+    if ((csr & WR_CSR_ARM) && !isArmed(rp)) {
+        struct capture *cp;
+        int b;
+
+        latchCapture(rp);
+        b = chooseBuffer(rp);
+        if ((b < 0) || bufferIsReferenced(rp, b))
+            return 0;
+        cp = &rp->capture[b];
+        if (cp->state == CAP_QUEUED) {
+            cp->unsentMask = 0;
+            rp->capturesDropped++;
+            if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+                printf("WFR %d dropped acquisition %u\n", rp->recorderNumber,
+                                                        cp->waveformNumber);
+        }
+        if (b == rp->latestIndex)
+            rp->latestIndex = -1;
+        cp->state = CAP_FILLING;
+        cp->waveformNumber = ++rp->acquisitionNumber;
+        cp->pretrigCount = rp->pretrigCount;
+        cp->samplesPerSegment = rp->acqCount;
+        cp->segmentCount = 1;
+        cp->segmentShift = 0;
+        if (rp->recorderNumber != 0) {
             /*
-             * The buffer is almost certainly bigger than the cache
-             * so it's fine to simply invalidate everything.
-             * After discussions with Xilinx and much testing I've
-             * confirmed that this is in fact the correct call.
-             * A call to 'Invalidate' seems to result in a mangled
-             * system.  This is likely because the cache is write-back.
+             * Segment regions are the smallest power of
+             * two, and at least 8 samples, that will hold
+             * an acquisition.
              */
-            Xil_DCacheFlush();
-            rp->retryCount = 0;
-            if (csr & WR_CSR_DIAGNOSTIC_MODE) {
-                if (rp->recorderNumber == 0)
-                    adcRecorderDiagnosticCheck(rp);
+            if (rp->segmentCount > 1) {
+                unsigned int shift = 3;
+                while ((1U << shift) < rp->acqCount)
+                    shift++;
+                cp->segmentCount = rp->acqSampleCapacity >> shift;
+                if (cp->segmentCount > rp->segmentCount)
+                    cp->segmentCount = rp->segmentCount;
+                if (cp->segmentCount > 1)
+                    cp->segmentShift = shift;
                 else
-                    recorderDiagnosticCheck(rp);
+                    cp->segmentCount = 1;
             }
-            p = headerPacket(rp);
+            wrWrite(rp, WR_REG_OFFSET_SEGMENT_CONFIG,
+                             (cp->segmentShift << 8) | (cp->segmentCount - 1));
+        }
+        rp->fillIndex = b;
+        wrWrite(rp, WR_REG_OFFSET_ADDRESS_POINTER, (uint32_t)cp->base);
+        wrWrite(rp, WR_REG_OFFSET_ACQUISITION_COUNT, rp->acqCount);
+        wrWrite(rp, WR_REG_OFFSET_PRETRIGGER_COUNT, rp->pretrigCount);
+    }
+    wrWrite(rp, WR_REG_OFFSET_CSR, csr);
+    return 1;
+}
+
+/*
+ * Start or stop free-running fast acquisition recorder
+ */
+static void
+streamStop(void)
+{
+    struct recorder *rp = stream.rp;
+
+    if (rp == NULL)
+        return;
+    wrWrite(rp, WR_REG_OFFSET_CSR, rp->csrModeBits);
+    rp->capture[rp->fillIndex].state = CAP_FREE;
+    stream.rp = NULL;
+    stream.samplesPerPacket = 0;
+}
+
+/*
+ * Returns 0, with any triggered acquisition that was
+ * disarmed rearmed, if no buffer is free for the stream.
+ */
+static int
+streamStart(struct recorder *rp, unsigned int samplesPerPacket)
+{
+    struct capture *cp;
+    int b;
+    epicsUInt32 armCSR = 0;
+
+    streamStop();
+    if (rp->armPending)
+        armCSR = rp->armPendingCSR;
+    else if (isArmed(rp))
+        armCSR = ((rp->triggerMask & 0xFF) << 24) | rp->csrModeBits |
+                                                                WR_CSR_ARM;
+    if (armCSR)
+        wrWrite(rp, WR_REG_OFFSET_CSR, rp->csrModeBits);
+    rp->armPending = 0;
+    latchCapture(rp);
+    b = chooseBuffer(rp);
+    if ((b < 0) || bufferIsReferenced(rp, b)) {
+        if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+            printf("WFR %d no buffer for stream\n", rp->recorderNumber);
+        if (armCSR && !writeCSR(rp, armCSR)) {
+            rp->armPending = 1;
+            rp->armPendingCSR = armCSR;
+        }
+        return 0;
+    }
+    cp = &rp->capture[b];
+    if (cp->state == CAP_QUEUED) {
+        cp->unsentMask = 0;
+        rp->capturesDropped++;
+        if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+            printf("WFR %d dropped acquisition %u\n", rp->recorderNumber,
+                                                        cp->waveformNumber);
+    }
+    if (b == rp->latestIndex)
+        rp->latestIndex = -1;
+    cp->state = CAP_FILLING;
+    rp->fillIndex = b;
+    stream.rp = rp;
+    stream.base = cp->base;
+    stream.samplesPerPacket = samplesPerPacket;
+    stream.writeIndex = 0;
+    stream.writtenCount = 0;
+    stream.sentCount = 0;
+
+    /*
+     * With no trigger enabled the recorder runs until disarmed
+     */
+    wrWrite(rp, WR_REG_OFFSET_ADDRESS_POINTER, (uint32_t)stream.base);
+    wrWrite(rp, WR_REG_OFFSET_SEGMENT_CONFIG, 0);
+    wrWrite(rp, WR_REG_OFFSET_PRETRIGGER_COUNT, 0);
+    wrWrite(rp, WR_REG_OFFSET_ACQUISITION_COUNT, rp->acqSampleCapacity);
+    wrWrite(rp, WR_REG_OFFSET_CSR, rp->csrModeBits | WR_CSR_ARM);
+    if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+        printf("WFR %d streaming %u samples per packet\n", rp->recorderNumber,
+                                                            samplesPerPacket);
+    return 1;
+}
+
+/*
+ * Copy samples from the fast acquisition ring buffer
+ */
+static void
+streamCopy(void *dst, unsigned int firstSample, unsigned int sampleCount)
+{
+    struct recorder *rp = stream.rp;
+    unsigned int offset, l1, l2;
+
+    offset = (firstSample % rp->acqSampleCapacity) * rp->bytesPerSample;
+    l1 = sampleCount * rp->bytesPerSample;
+    l2 = 0;
+    if ((offset + l1) > rp->acqByteCapacity) {
+        l2 = offset + l1 - rp->acqByteCapacity;
+        l1 -= l2;
+    }
+    Xil_DCacheFlushRange((unsigned int)(stream.base + offset), l1);
+    memcpy(dst, stream.base + offset, l1);
+    if (l2) {
+        Xil_DCacheFlushRange((unsigned int)stream.base, l2);
+        memcpy((char *)dst + l1, stream.base, l2);
+    }
+}
+
+/*
+ * Time at which a sample was acquired, given the time
+ * at which a later sample was found in memory
+ */
+static void
+streamSampleTime(evrTimestamp *ts, unsigned int sampleCount)
+{
+    uint32_t evrRate = GPIO_READ(GPIO_IDX_EVR_CLOCK_RATE);
+    unsigned long long back;
+
+    /* No timing system -- leave time stamp as is */
+    if (evrRate == 0)
+        return;
+    back = (unsigned long long)sampleCount * systemParameters.evrPerFaMarker;
+    ts->secPastEpoch -= back / evrRate;
+    back %= evrRate;
+    if (ts->ticks < back) {
+        ts->ticks += evrRate;
+        ts->secPastEpoch--;
+    }
+    ts->ticks -= back;
+}
+
+/*
+ * Hand back the next stream packet, if any
+ */
+static struct pbuf *
+streamCheckForWork(void)
+{
+    struct recorder *rp = stream.rp;
+    struct pbuf *p;
+    struct bpmFaStream *sp;
+    unsigned int w, committed, n = stream.samplesPerPacket;
+    evrTimestamp now;
+
+    if (rp == NULL)
+        return NULL;
+
+    /*
+     * Find how far the recorder has advanced
+     */
+    evrCurrentTime(&now);
+    w = ((char *)WR_READ(rp, WR_REG_OFFSET_ADDRESS_POINTER) - stream.base) /
+                                                            rp->bytesPerSample;
+    w %= rp->acqSampleCapacity;
+    stream.writtenCount += (w + rp->acqSampleCapacity - stream.writeIndex) %
+                                                        rp->acqSampleCapacity;
+    stream.writeIndex = w;
+    committed = stream.writtenCount;
+    if (committed < STREAM_GUARD_SAMPLES)
+        return NULL;
+    committed -= STREAM_GUARD_SAMPLES;
+
+    /*
+     * Drop packets the recorder is about to overwrite
+     */
+    while ((committed - stream.sentCount) >
+                            (rp->acqSampleCapacity - STREAM_LAG_MARGIN(rp))) {
+        stream.sentCount += n;
+        stream.packetNumber++;
+        stream.packetsDropped++;
+    }
+
+    /*
+     * Send the oldest packet once all its samples have arrived
+     */
+    if ((int)(committed - (stream.sentCount + n)) < 0)
+        return NULL;
+    p = pbuf_alloc(PBUF_TRANSPORT,
+                   offsetof(struct bpmFaStream, sample) + (n * 16), PBUF_RAM);
+    if (p == NULL)
+        return NULL;
+    sp = (struct bpmFaStream *)p->payload;
+    sp->magic = BPM_PROTOCOL_MAGIC_FA_STREAM;
+    sp->packetNumber = stream.packetNumber++;
+    sp->firstSample = stream.sentCount;
+    sp->sampleCount = n;
+    sp->pad = 0;
+    streamSampleTime(&now, committed - stream.sentCount);
+    sp->seconds = now.secPastEpoch;
+    sp->ticks = now.ticks;
+    streamCopy(sp->sample, stream.sentCount, n);
+    stream.sentCount += n;
+    stream.packetsSent++;
+    return p;
+}
+
+/*
+ * Start sending a capture to a subscriber
+ */
+static struct pbuf *
+transferStart(struct transfer *tp, int b, unsigned int waveformNumber,
+              int isRoi)
+{
+    struct recorder *rp = tp->rp;
+    struct capture *cp = &rp->capture[b];
+
+    cp->activeCount++;
+    captureUpdate(cp);
+    tp->xferIndex = b;
+    tp->acqBuf = cp->base;
+    tp->waveformNumber = waveformNumber;
+    tp->retryCount = 0;
+    tp->isRoi = isRoi;
+    if (!isRoi && cp->envPointCount) {
+        tp->envFirstPoint = 0;
+        tp->commState = CS_ENVELOPE;
+        return envelopePacket(tp);
+    }
+    return headerPacket(tp);
+}
+
+/*
+ * Hand back a pointer to the next packet a transfer has to transmit
+ */
+static struct pbuf *
+transferCheckForWork(struct transfer *tp)
+{
+    struct recorder *rp = tp->rp;
+    struct pbuf *p = NULL;
+    uint32_t now;
+
+    /*
+     * Send a header when a buffer is waiting to be sent to this
+     * subscriber or a region of interest has been requested.
+     */
+    if (tp->commState == CS_IDLE) {
+        int b, queued = -1;
+        unsigned int bit = 1U << tp->subscriber;
+        transferRelease(tp);
+        for (b = 0 ; b < BUFFERS_PER_RECORDER ; b++) {
+            struct capture *cp = &rp->capture[b];
+            if ((cp->unsentMask & bit)
+             && ((queued < 0)
+              || ((int)(cp->waveformNumber -
+                        rp->capture[queued].waveformNumber) < 0)))
+                queued = b;
+        }
+        if (queued >= 0) {
+            struct capture *cp = &rp->capture[queued];
+            cp->unsentMask &= ~bit;
+            p = transferStart(tp, queued, cp->waveformNumber, 0);
+        }
+        else if (tp->roiPending) {
+            tp->roiPending = 0;
+            if (rp->latestIndex >= 0)
+                p = transferStart(tp, rp->latestIndex,
+                                  rp->roiWaveformNumber, 1);
         }
     }
+    else if (tp->commState == CS_ENVELOPE) {
+        if (tp->envFirstPoint < rp->capture[tp->xferIndex].envPointCount)
+            p = envelopePacket(tp);
+        else
+            p = headerPacket(tp);
+    }
     else {
         now = sysTicksSinceBoot();
-        if ((now - rp->sysTicksAtPreviousPacket) > TIMEOUT_TICKS) {
-            if (++rp->retryCount < RETRY_LIMIT) {
+        if ((now - tp->sysTicksAtPreviousPacket) > TIMEOUT_TICKS) {
+            rp->timeouts++;
+            if (++tp->retryCount < RETRY_LIMIT) {
                 /*
                  * Retry the transmission.
                  * It might seem like a good idea to just hang on to the
                  * pbuf pointer and return it again, but that turns out to
                  * be a really bad idea since udp_sendto mangles the pbuf.
                  */
-                switch (rp->commState) {
-                case CS_HEADER: p = headerPacket(rp); break;
-                case CS_ACTIVE: p = dataPacket(rp);   break;
+                switch (tp->commState) {
+                case CS_HEADER: p = headerPacket(tp); break;
+                case CS_ACTIVE:
+                    if (tp->isWindowed) {
+                        /* Resend everything not yet acknowledged */
+                        tp->retxBlock = tp->ackBlock;
+                        tp->retxLimit = tp->txBlock;
+                        p = windowPacket(tp);
+                    }
+                    else {
+                        p = lockstepPacket(tp);
+                    }
+                    break;
                 default:                              break;
                 }
             }
             else {
-                rp->commState = CS_IDLE;
+                tp->commState = CS_IDLE;
             }
         }
+        else if ((tp->commState == CS_ACTIVE) && tp->isWindowed) {
+            p = windowPacket(tp);
+        }
     }
     return p;
 }
 
+/*
+ * Hand back a pointer to the next packet a recorder has to transmit
+ * and the subscriber to which it is to be sent.
+ * Rotate through subscribers so each gets a fair share.
+ */
+static struct pbuf *
+recorderCheckForWork(struct recorder *rp, int *subscriber)
+{
+    struct pbuf *p;
+    int i;
+
+    /*
+     * Complete any arm request that was waiting on
+     * the network driver to release the buffer.
+     */
+    if (rp->armPending && writeCSR(rp, rp->armPendingCSR))
+        rp->armPending = 0;
+    latchCapture(rp);
+    for (i = 0 ; i < BUFFERS_PER_RECORDER ; i++) {
+        if (rp->capture[i].state == CAP_PACKING)
+            packCheckForWork(rp, &rp->capture[i]);
+        else
+            envelopeCheckForWork(rp, &rp->capture[i]);
+    }
+
+    for (i = 0 ; i < PUBLISHER_SUBSCRIBER_CAPACITY ; i++) {
+        int s = (rp->xferRotor + 1 + i) % PUBLISHER_SUBSCRIBER_CAPACITY;
+        if (!(subscriberMask & (1 << s)))
+            continue;
+        if ((p = transferCheckForWork(&rp->xfer[s])) != NULL) {
+            rp->xferRotor = s;
+            *subscriber = s;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Called from publisher work-check routine
+ * Hand back a pointer to the packet to be transmitted.
+ * The publisher calls repeatedly until this returns NULL which
+ * happens when no recorder has anything to send or the budget
+ * for this pass has been used up.
+ * The subscriber index is set to -1 for packets to be sent to all.
+ */
+struct pbuf *
+wfrCheckForWork(int *subscriber)
+{
+    static int recorderIndex;
+    static unsigned int passPackets, passBytes;
+    int i, j, order[BPM_PROTOCOL_RECORDER_COUNT];
+    struct recorder *rp;
+    struct pbuf *p;
+    uint32_t then;
+
+    /*
+     * Release packets and buffer segments the
+     * network driver has finished with
+     */
+    releaseTxPbufs();
+    for (i = 0 ; i < BPM_PROTOCOL_RECORDER_COUNT ; i++)
+        releaseRefPbufs(&recorder[i]);
+    if ((passPackets >= PASS_PACKET_LIMIT)
+     || (passBytes >= PASS_BYTE_LIMIT)
+     || (txPbufCount >= TX_QUEUE_LIMIT)) {
+        passPackets = passBytes = 0;
+        return NULL;
+    }
+
+    /*
+     * Stream data goes ahead of everything else
+     */
+    then = sysTicksSinceBoot();
+    if ((p = streamCheckForWork()) != NULL) {
+        profileEnd(PROFILE_WFR_STREAM, then);
+        *subscriber = -1;
+        passPackets++;
+        passBytes += p->tot_len;
+        return txTrack(p);
+    }
+
+    /*
+     * Visit recorders in priority order, rotating
+     * through recorders of the same priority.
+     */
+    for (i = 0 ; i < BPM_PROTOCOL_RECORDER_COUNT ; i++) {
+        int r = (recorderIndex + 1 + i) % BPM_PROTOCOL_RECORDER_COUNT;
+        for (j = i ; (j > 0) &&
+                     (recorder[order[j-1]].priority < recorder[r].priority) ;
+                                                                         j--)
+            order[j] = order[j-1];
+        order[j] = r;
+    }
+    for (i = 0 ; i < BPM_PROTOCOL_RECORDER_COUNT ; i++) {
+        rp = &recorder[order[i]];
+        if ((p = recorderCheckForWork(rp, subscriber)) != NULL) {
+            recorderIndex = order[i];
+            passPackets++;
+            passBytes += p->tot_len;
+            return txTrack(p);
+        }
+    }
+    passPackets = passBytes = 0;
+    return NULL;
+}
+
+/*
+ * Show transfer statistics
+ */
+void
+wfrShowStatistics(void)
+{
+    int i;
+    uint32_t now = sysTicksSinceBoot();
+
+    printf("WFR Pri   Packets      Bytes Compressed  Resent Timeouts  Done"
+                                                        " Dropped   kB/s\n");
+    for (i = 0 ; i < BPM_PROTOCOL_RECORDER_COUNT ; i++) {
+        struct recorder *rp = &recorder[i];
+        uint32_t ticks = now - rp->sysTicksAtPreviousShow;
+        uint32_t bytes = rp->bytesSent - rp->bytesAtPreviousShow;
+        unsigned int ms = ticks / (XPAR_MICROBLAZE_FREQ / 1000);
+        unsigned int rate = ms ? bytes / ms : 0;
+        printf("%3d %3d %9u %10u %10u %7u %8u %5u %7u %6u\n", i, rp->priority,
+                                  (unsigned int)rp->packetsSent,
+                                  (unsigned int)rp->bytesSent,
+                                  (unsigned int)rp->blocksCompressed,
+                                  (unsigned int)rp->blocksResent,
+                                  (unsigned int)rp->timeouts,
+                                  (unsigned int)rp->transfersCompleted,
+                                  (unsigned int)rp->capturesDropped, rate);
+        rp->bytesAtPreviousShow = rp->bytesSent;
+        rp->sysTicksAtPreviousShow = now;
+    }
+    if (stream.rp) {
+        printf("Stream: %u samples/packet, %u packets sent, %u dropped\n",
+                                        stream.samplesPerPacket,
+                                        (unsigned int)stream.packetsSent,
+                                        (unsigned int)stream.packetsDropped);
+    }
+}
+
+/*
+ * Compare cost of compression against bytes saved.
+ * Uses whatever each recorder most recently acquired, in blocks of the
+ * size negotiated by the first subscriber asking for compression, or
+ * by the first subscriber if none is.
+ */
+void
+wfrCompressionBenchmark(void)
+{
+    int s, b, n;
+    static unsigned char cbuf[BPM_PROTOCOL_WAVEFORM_MAX_PAYLOAD_CAPACITY];
+    const int blockLimit = 64;
+    unsigned int blockSize = BPM_PROTOCOL_WAVEFORM_PAYLOAD_CAPACITY;
+    struct recorder *rp;
+
+    for (s = PUBLISHER_SUBSCRIBER_CAPACITY - 1 ; s >= 0 ; s--) {
+        if (subscriberMask & (1 << s))
+            blockSize = subscription[s].payloadCapacity;
+    }
+    for (s = PUBLISHER_SUBSCRIBER_CAPACITY - 1 ; s >= 0 ; s--) {
+        if ((subscriberMask & (1 << s))
+         && (subscription[s].options &
+                                BPM_PROTOCOL_SUBSCRIBE_WAVEFORM_COMPRESSION))
+            blockSize = subscription[s].payloadCapacity;
+    }
+    printf("WFR  Block      Bytes Compressed Ratio Cycles/byte  MB/s\n");
+    for (rp = recorder ; rp < &recorder[BPM_PROTOCOL_RECORDER_COUNT] ; rp++) {
+        unsigned int raw = 0, compressed = 0, offset, bytesLeft, l;
+        uint32_t then, ticks, us;
+        struct capture *cp;
+        if (rp->latestIndex < 0) {
+            printf("%3d    No acquisition\n", rp->recorderNumber);
+            continue;
+        }
+        cp = &rp->capture[rp->latestIndex];
+        bytesLeft = captureLocate(rp, cp, &offset) * rp->bytesPerSample;
+        then = sysTicksSinceBoot();
+        for (b = 0 ; (b < blockLimit) && (bytesLeft != 0) ; b++) {
+            l = (bytesLeft < blockSize) ? bytesLeft : blockSize;
+            n = wfrCompress(cbuf, l - 1, cp->base, rp->acqByteCapacity,
+                            offset, l, rp->bytesPerSample);
+            raw += l;
+            compressed += (n < 0) ? l : n;
+            offset = (offset + l) % rp->acqByteCapacity;
+            bytesLeft -= l;
+        }
+        ticks = sysTicksSinceBoot() - then;
+        us = ticks / (XPAR_MICROBLAZE_FREQ / 1000000);
+        if (raw == 0)
+            continue;
+        printf("%3d %6d %10u %10u %4u%% %7u.%u %9u\n", rp->recorderNumber,
+                              blockSize, raw, compressed,
+                              (compressed * 100) / raw,
+                              ticks / raw, ((ticks % raw) * 10) / raw,
+                              us ? raw / us : 0);
+    }
+}
+
 /*
  * Called from server packet handler
  */
@@ -563,25 +2243,27 @@ waveformRecorderCommand(const struct bpmCommand *cmd, struct bpmReply *reply)
         return;
     switch (code) {
     case BPM_PROTOCOL_COMMAND_WF_ARM:
-        if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
+        if ((cmd->code & BPM_PROTOCOL_WRITE_MASK) && (stream.rp != rp)) {
             epicsUInt32 csr = (rp->triggerMask & 0xFF) << 24;
-            if (val) {
-                if (!isArmed(rp)) {
-                    wrWrite(rp, WR_REG_OFFSET_ACQUISITION_COUNT, rp->acqCount);
-                    wrWrite(rp, WR_REG_OFFSET_PRETRIGGER_COUNT, rp->pretrigCount);
-                    rp->waveformNumber++;
-                }
-                rp->commState = CS_IDLE;
+            if (val)
                 csr |= WR_CSR_ARM;
-            }
             if (debugFlags & DEBUGFLAG_RECORDER_DIAG)
                 rp->csrModeBits |= WR_CSR_DIAGNOSTIC_MODE;
             else
                 rp->csrModeBits &= ~WR_CSR_DIAGNOSTIC_MODE;
             csr |= rp->csrModeBits;
-            wrWrite(rp, WR_REG_OFFSET_CSR, csr);
+            if (writeCSR(rp, csr)) {
+                rp->armPending = 0;
+            }
+            else {
+                /* Network driver still has packets referring to buffer */
+                if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+                    printf("WFR %d arm deferred\n", rp->recorderNumber);
+                rp->armPending = 1;
+                rp->armPendingCSR = csr;
+            }
         }
-        ret = isArmed(rp);
+        ret = isArmed(rp) || rp->armPending;
         break;
 
     case BPM_PROTOCOL_COMMAND_WF_TRIGGER_MASK:
@@ -608,6 +2290,103 @@ waveformRecorderCommand(const struct bpmCommand *cmd, struct bpmReply *reply)
         ret = rp->acqCount;
         break;
 
+    case BPM_PROTOCOL_COMMAND_WF_PRIORITY:
+        if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
+            if (val > PRIORITY_MAX) val = PRIORITY_MAX;
+            rp->priority = val;
+        }
+        ret = rp->priority;
+        break;
+
+    case BPM_PROTOCOL_COMMAND_WF_BYTES_SENT:
+        if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
+            rp->packetsSent = 0;
+            rp->bytesSent = 0;
+            rp->blocksCompressed = 0;
+            rp->blocksResent = 0;
+            rp->timeouts = 0;
+            rp->transfersCompleted = 0;
+            rp->capturesDropped = 0;
+            rp->bytesAtPreviousShow = 0;
+            rp->sysTicksAtPreviousShow = sysTicksSinceBoot();
+        }
+        ret = rp->bytesSent;
+        break;
+
+    case BPM_PROTOCOL_COMMAND_WF_ENVELOPE_POINTS:
+        if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
+            if (val > BPM_PROTOCOL_ENVELOPE_POINT_LIMIT)
+                val = BPM_PROTOCOL_ENVELOPE_POINT_LIMIT;
+            rp->envelopePointCount = val;
+        }
+        ret = rp->envelopePointCount;
+        break;
+
+    case BPM_PROTOCOL_COMMAND_WF_ROI_FIRST_SAMPLE:
+        if (cmd->code & BPM_PROTOCOL_WRITE_MASK)
+            rp->roiFirstSample = val;
+        ret = rp->roiFirstSample;
+        break;
+
+    case BPM_PROTOCOL_COMMAND_WF_ROI_SAMPLE_COUNT:
+        if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
+            rp->roiSampleCount = val;
+            if (rp->latestIndex >= 0) {
+                /* Sent once any transfer in progress completes */
+                int s;
+                if (debugFlags & DEBUGFLAG_WAVEFORM_HEAD)
+                    printf("WFR %d ROI %d:%d mask %X\n", rp->recorderNumber,
+                                               rp->roiFirstSample, val,
+                                               rp->roiChannelMask);
+                rp->roiWaveformNumber = ++rp->acquisitionNumber;
+                for (s = 0 ; s < PUBLISHER_SUBSCRIBER_CAPACITY ; s++) {
+                    if (subscriberMask & (1 << s))
+                        rp->xfer[s].roiPending = 1;
+                }
+            }
+        }
+        ret = rp->roiSampleCount;
+        break;
+
+    case BPM_PROTOCOL_COMMAND_WF_ROI_CHANNEL_MASK:
+        if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
+            val &= ALL_CHANNELS;
+            if (val == 0) val = ALL_CHANNELS;
+            rp->roiChannelMask = val;
+        }
+        ret = rp->roiChannelMask;
+        break;
+
+    case BPM_PROTOCOL_COMMAND_WF_STREAM:
+        if (rp->regBase != GPIO_IDX_FA_RECORDER_BASE)
+            return;
+        if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
+            unsigned int limit = minimumPayloadCapacity() / rp->bytesPerSample;
+            if (val > limit) val = limit;
+            if (val > 0) {
+                /* Client sees a readback of 0 if stream can't start */
+                if (!streamStart(rp, val)) {
+                    ret = 0;
+                    break;
+                }
+            }
+            else if (stream.rp == rp)
+                streamStop();
+        }
+        ret = (stream.rp == rp) ? stream.samplesPerPacket : 0;
+        break;
+
+    case BPM_PROTOCOL_COMMAND_WF_SEGMENT_COUNT:
+        if (rp->recorderNumber == 0)
+            return;
+        if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
+            if (val > BPM_PROTOCOL_SEGMENT_CAPACITY)
+                val = BPM_PROTOCOL_SEGMENT_CAPACITY;
+            rp->segmentCount = val;
+        }
+        ret = rp->segmentCount;
+        break;
+
     case BPM_PROTOCOL_COMMAND_WF_ACQUISITION_MODE:
         if (cmd->code & BPM_PROTOCOL_WRITE_MASK) {
             if (val) rp->csrModeBits |=  WR_CSR_TEST_ACQUISITION_MODE;
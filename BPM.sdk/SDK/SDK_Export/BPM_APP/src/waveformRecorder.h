@@ -12,8 +12,15 @@ void wfrInit(void);
 
 void waveformRecorderCommand(const struct bpmCommand *cmd, struct bpmReply *reply);
 
-struct pbuf *wfrAckPacket(struct bpmWaveformAck *ackp);
-struct pbuf *wfrCheckForWork(void);
+struct pbuf *wfrAckPacket(int subscriber, struct bpmWaveformAck *ackp);
+struct pbuf *wfrWindowAckPacket(int subscriber,
+                                struct bpmWaveformWindowAck *ackp);
+struct pbuf *wfrCheckForWork(int *subscriber);
+void wfrSetSubscription(int subscriber, unsigned int capacity,
+                                        unsigned int options);
+void wfrUnsubscribe(int subscriber);
+void wfrShowStatistics(void);
+void wfrCompressionBenchmark(void);
 int wfrStatus(void);
 
 #endif
@@ -5,6 +5,9 @@
 *    1 - The include paths were changed to allow the build to find the files.
 *    2 - The BPM 'check for work' routine is now invoked from the flash
 *        status register polling routine.
+*    3 - Routines to start a block erase or a single write buffer program
+*        operation and to poll for its completion were added so that the
+*        BPM can program the flash without blocking.
 *****************************************************************************/
 
 /******************************************************************************
@@ -2939,6 +2942,196 @@ static int SetRYBY(XFlash *InstancePtr, u32 Mode)
 	return (XST_SUCCESS);
 }
 
+/*****************************************************************************/
+/**
+*
+* Starts erasing the block containing the specified offset and returns
+* without waiting for the erase to complete.  Use XFlashIntel_Poll() to
+* determine when the erase has completed.
+*
+* @param	InstancePtr is the pointer to the XFlash instance.
+* @param	Offset is an offset within the block to be erased.
+*
+* @return
+*		- XST_SUCCESS if the erase was started.
+*		- XFLASH_ADDRESS_ERROR if the offset is not within the part.
+*
+* @note		The block must already be unlocked.
+*
+******************************************************************************/
+int XFlashIntel_EraseStart(XFlash *InstancePtr, u32 Offset)
+{
+	XFlashVendorData_Intel *DevDataPtr;
+	u16 Region, Block;
+	u32 Dummy;
+	u32 BlockAddress;
+
+	if(InstancePtr == NULL) {
+		return XST_FAILURE;
+	}
+
+	if (XFlashGeometry_ToBlock(&InstancePtr->Geometry, Offset, &Region,
+				   &Block, &Dummy) != XST_SUCCESS) {
+		return (XFLASH_ADDRESS_ERROR);
+	}
+	(void) XFlashGeometry_ToAbsolute(&InstancePtr->Geometry, Region, Block,
+					 0, &BlockAddress);
+
+	DevDataPtr = GET_PARTDATA(InstancePtr);
+	DevDataPtr->SendCmd(InstancePtr->Geometry.BaseAddress, BlockAddress,
+			    XFL_INTEL_CMD_CLEAR_STATUS_REG);
+	DevDataPtr->SendCmdSeq(InstancePtr->Geometry.BaseAddress, BlockAddress,
+			       XFL_INTEL_CMD_BLOCK_ERASE,
+			       XFL_INTEL_CMD_CONFIRM);
+
+	return (XST_SUCCESS);
+}
+
+/*****************************************************************************/
+/**
+*
+* Starts programming a single write buffer and returns without waiting for
+* the program operation to complete.  Use XFlashIntel_Poll() to determine
+* when the operation has completed.
+*
+* @param	InstancePtr is the pointer to the XFlash instance.
+* @param	Offset is the offset in the part of the first byte to program.
+* @param	SrcPtr is the source data.
+* @param	Bytes is the number of bytes to program.
+*
+* @return
+*		- XST_SUCCESS if the program operation was started.
+*		- XFLASH_ALIGNMENT_ERROR if the source or destination is not
+*		  aligned to a 16-bit word.
+*		- XFLASH_ADDRESS_ERROR if the range is not within a single
+*		  write buffer.
+*		- XFLASH_NOT_SUPPORTED if the part is not on a 16-bit bus.
+*
+* @note		Locations in the write buffer outside the specified range
+*		are padded with 0xFF and so are left unchanged.
+*
+******************************************************************************/
+int XFlashIntel_WriteBufferStart(XFlash *InstancePtr, u32 Offset,
+				 void *SrcPtr, u32 Bytes)
+{
+	XFlashVendorData_Intel *DevDataPtr;
+	u16 *SrcWordPtr = (u16*)SrcPtr;
+	u16 *DestWordPtr;
+	u16 StatusReg;
+	u16 ReadyMask;
+	u16 Word;
+	u32 BytesLeft = Bytes;
+	u32 PartialBytes;
+	u32 Count;
+	u32 Index;
+
+	if(InstancePtr == NULL) {
+		return XST_FAILURE;
+	}
+
+	DevDataPtr = GET_PARTDATA(InstancePtr);
+	if (DevDataPtr->WriteBuffer != WriteBuffer16) {
+		return (XFLASH_NOT_SUPPORTED);
+	}
+	if ((Offset & 1) || ((int) SrcWordPtr & 1)) {
+		return (XFLASH_ALIGNMENT_ERROR);
+	}
+	PartialBytes = Offset &
+		InstancePtr->Properties.ProgCap.WriteBufferAlignmentMask;
+	Count = InstancePtr->Properties.ProgCap.WriteBufferSize >> 1;
+	if ((PartialBytes + Bytes) >
+			InstancePtr->Properties.ProgCap.WriteBufferSize) {
+		return (XFLASH_ADDRESS_ERROR);
+	}
+	ReadyMask = DevDataPtr->SR_WsmReady.Mask16;
+	DestWordPtr = (u16*)(InstancePtr->Geometry.BaseAddress + Offset -
+								PartialBytes);
+
+	/*
+	 * Send command to write buffer. Wait for buffer to become
+	 * available. Write number of words to be written (always the
+	 * maximum).
+	 */
+	WRITE_FLASH_16(DestWordPtr, InstancePtr->Command.WriteBufferCommand);
+	StatusReg = READ_FLASH_16(DestWordPtr);
+	while ((StatusReg & ReadyMask) != ReadyMask) {
+		StatusReg = READ_FLASH_16(DestWordPtr);
+	}
+	WRITE_FLASH_16(DestWordPtr, DevDataPtr->WriteBufferWordCount);
+
+	/*
+	 * Fill the buffer, padding before and after the source data
+	 */
+	for (Index = 0; Index < Count; Index++) {
+		Word = 0xFFFF;
+		if ((Index << 1) >= PartialBytes) {
+			if (BytesLeft > 1) {
+				Word = *SrcWordPtr++;
+				BytesLeft -= 2;
+			}
+			else if (BytesLeft == 1) {
+				#ifdef XPAR_AXI_EMC
+				Word = 0xFF00 | *SrcWordPtr;
+				#else
+				Word = 0x00FF | *SrcWordPtr;
+				#endif
+				BytesLeft--;
+			}
+		}
+		WRITE_FLASH_16(&DestWordPtr[Index], Word);
+	}
+
+	/*
+	 * Send confirmation, but don't wait for status
+	 */
+	WRITE_FLASH_16(DestWordPtr, XFL_INTEL_CMD_CONFIRM);
+
+	return (XST_SUCCESS);
+}
+
+/*****************************************************************************/
+/**
+*
+* Checks, without waiting, whether an operation started by
+* XFlashIntel_EraseStart() or XFlashIntel_WriteBufferStart() has completed.
+* Once it has, the part is returned to read-array mode.
+*
+* @param	InstancePtr is the pointer to the XFlash instance.
+* @param	Offset is the offset passed to the routine that started the
+*		operation.
+*
+* @return
+*		- XFLASH_BUSY if the operation is still in progress.
+*		- XFLASH_READY if the operation completed successfully.
+*		- XFLASH_ERROR if the operation failed.
+*
+* @note		None.
+*
+******************************************************************************/
+int XFlashIntel_Poll(XFlash *InstancePtr, u32 Offset)
+{
+	XFlashVendorData_Intel *DevDataPtr;
+	u32 BaseAddress;
+	int Status;
+
+	if(InstancePtr == NULL) {
+		return XST_FAILURE;
+	}
+
+	DevDataPtr = GET_PARTDATA(InstancePtr);
+	BaseAddress = InstancePtr->Geometry.BaseAddress;
+	Offset &= ~1;
+	Status = DevDataPtr->GetStatus(InstancePtr, Offset);
+	if (Status == XFLASH_BUSY) {
+		return (XFLASH_BUSY);
+	}
+	DevDataPtr->SendCmd(BaseAddress, Offset,
+			    XFL_INTEL_CMD_CLEAR_STATUS_REG);
+	DevDataPtr->SendCmd(BaseAddress, Offset, XFL_INTEL_CMD_READ_ARRAY);
+
+	return (Status);
+}
+
 /*****************************************************************************/
 /**
 *
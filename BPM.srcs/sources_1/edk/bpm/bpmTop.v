@@ -577,19 +577,8 @@ wire [MAG_WIDTH-1:0] prelimProcPlMag2, prelimProcPlMag3;
 wire [MAG_WIDTH-1:0] prelimProcPhMag0, prelimProcPhMag1;
 wire [MAG_WIDTH-1:0] prelimProcPhMag2, prelimProcPhMag3;
 wire prelimProcPtToggle, prelimProcOverflow;
+wire [63:0] prelimProcSaTimestamp;
 assign FP_LED[1] = !prelimProcOverflow;  // First green LED
-assign GPIO_IN[GPIO_IDX_PRELIM_RF_MAG_0] = { magPAD, prelimProcRfMag0 };
-assign GPIO_IN[GPIO_IDX_PRELIM_RF_MAG_1] = { magPAD, prelimProcRfMag1 };
-assign GPIO_IN[GPIO_IDX_PRELIM_RF_MAG_2] = { magPAD, prelimProcRfMag2 };
-assign GPIO_IN[GPIO_IDX_PRELIM_RF_MAG_3] = { magPAD, prelimProcRfMag3 };
-assign GPIO_IN[GPIO_IDX_PRELIM_PT_LO_MAG_0] = { magPAD, prelimProcPlMag0 };
-assign GPIO_IN[GPIO_IDX_PRELIM_PT_LO_MAG_1] = { magPAD, prelimProcPlMag1 };
-assign GPIO_IN[GPIO_IDX_PRELIM_PT_LO_MAG_2] = { magPAD, prelimProcPlMag2 };
-assign GPIO_IN[GPIO_IDX_PRELIM_PT_LO_MAG_3] = { magPAD, prelimProcPlMag3 };
-assign GPIO_IN[GPIO_IDX_PRELIM_PT_HI_MAG_0] = { magPAD, prelimProcPhMag0 };
-assign GPIO_IN[GPIO_IDX_PRELIM_PT_HI_MAG_1] = { magPAD, prelimProcPhMag1 };
-assign GPIO_IN[GPIO_IDX_PRELIM_PT_HI_MAG_2] = { magPAD, prelimProcPhMag2 };
-assign GPIO_IN[GPIO_IDX_PRELIM_PT_HI_MAG_3] = { magPAD, prelimProcPhMag3 };
 
 preliminaryProcessing #(.SYSCLK_RATE(SYSCLK_RATE),
                         .MAG_WIDTH(MAG_WIDTH),
@@ -652,8 +641,7 @@ preliminaryProcessing #(.SYSCLK_RATE(SYSCLK_RATE),
     .rfFaMag2(prelimProcRfFaMag2),
     .rfFaMag3(prelimProcRfFaMag3),
     .saToggle(prelimProcSaToggle),
-    .sysSaTimestamp({GPIO_IN[GPIO_IDX_SA_TIMESTAMP_SEC],
-                     GPIO_IN[GPIO_IDX_SA_TIMESTAMP_TICKS]}),
+    .sysSaTimestamp(prelimProcSaTimestamp),
     .rfMag0(prelimProcRfMag0),
     .rfMag1(prelimProcRfMag1),
     .rfMag2(prelimProcRfMag2),
@@ -683,10 +671,6 @@ assign GPIO_IN[GPIO_IDX_POSITION_CALC_CSR] = positionCalcCSR;
 assign GPIO_IN[GPIO_IDX_POSITION_CALC_XCAL] = positionCalcXcal;
 assign GPIO_IN[GPIO_IDX_POSITION_CALC_YCAL] = positionCalcYcal;
 assign GPIO_IN[GPIO_IDX_POSITION_CALC_QCAL] = positionCalcQcal;
-assign GPIO_IN[GPIO_IDX_POSITION_CALC_SA_X] = positionCalcSaX;
-assign GPIO_IN[GPIO_IDX_POSITION_CALC_SA_Y] = positionCalcSaY;
-assign GPIO_IN[GPIO_IDX_POSITION_CALC_SA_Q] = positionCalcSaQ;
-assign GPIO_IN[GPIO_IDX_POSITION_CALC_SA_S] = positionCalcSaS;
 positionCalc #(.MAG_WIDTH(MAG_WIDTH))
     positionCalc(.clk(sysClk),
                .gpioData(GPIO_OUT),
@@ -747,10 +731,6 @@ lossOfBeam lossOfBeam(.clk(sysClk),
 // RMS motion calculation
 //
 wire [31:0] wideXrms, wideYrms, narrowXrms, narrowYrms;
-assign GPIO_IN[GPIO_IDX_RMS_X_WIDE] = wideXrms;
-assign GPIO_IN[GPIO_IDX_RMS_Y_WIDE] = wideYrms;
-assign GPIO_IN[GPIO_IDX_RMS_X_NARROW] = narrowXrms;
-assign GPIO_IN[GPIO_IDX_RMS_Y_NARROW] = narrowYrms;
 rmsCalc rmsCalc(.clk(sysClk),
                 .faToggle(positionCalcFaToggle),
                 .faX(positionCalcFaX),
@@ -760,6 +740,77 @@ rmsCalc rmsCalc(.clk(sysClk),
                 .narrowXrms(narrowXrms),
                 .narrowYrms(narrowYrms));
 
+//
+// Slow acquisition snapshot
+// Latch all slow acquisition values together when the SA position
+// arrives so the processor always reads a consistent set.  The sequence
+// number advances with each update so the processor can tell when a new
+// set is available and can detect an update that arrives while it is
+// reading the set.
+//
+reg        saSnapToggle_d = 0;
+reg [31:0] saSnapSequence = 0;
+reg [63:0] saSnapTimestamp = 0;
+reg [31:0] saSnapX = 0, saSnapY = 0, saSnapQ = 0, saSnapS = 0;
+reg [31:0] saSnapWideXrms = 0, saSnapWideYrms = 0;
+reg [31:0] saSnapNarrowXrms = 0, saSnapNarrowYrms = 0;
+reg [MAG_WIDTH-1:0] saSnapRfMag0 = 0, saSnapRfMag1 = 0;
+reg [MAG_WIDTH-1:0] saSnapRfMag2 = 0, saSnapRfMag3 = 0;
+reg [MAG_WIDTH-1:0] saSnapPlMag0 = 0, saSnapPlMag1 = 0;
+reg [MAG_WIDTH-1:0] saSnapPlMag2 = 0, saSnapPlMag3 = 0;
+reg [MAG_WIDTH-1:0] saSnapPhMag0 = 0, saSnapPhMag1 = 0;
+reg [MAG_WIDTH-1:0] saSnapPhMag2 = 0, saSnapPhMag3 = 0;
+always @(posedge sysClk) begin
+    saSnapToggle_d <= positionCalcSaToggle;
+    if (positionCalcSaToggle != saSnapToggle_d) begin
+        saSnapSequence   <= saSnapSequence + 1;
+        saSnapTimestamp  <= prelimProcSaTimestamp;
+        saSnapX          <= positionCalcSaX;
+        saSnapY          <= positionCalcSaY;
+        saSnapQ          <= positionCalcSaQ;
+        saSnapS          <= positionCalcSaS;
+        saSnapWideXrms   <= wideXrms;
+        saSnapWideYrms   <= wideYrms;
+        saSnapNarrowXrms <= narrowXrms;
+        saSnapNarrowYrms <= narrowYrms;
+        saSnapRfMag0     <= prelimProcRfMag0;
+        saSnapRfMag1     <= prelimProcRfMag1;
+        saSnapRfMag2     <= prelimProcRfMag2;
+        saSnapRfMag3     <= prelimProcRfMag3;
+        saSnapPlMag0     <= prelimProcPlMag0;
+        saSnapPlMag1     <= prelimProcPlMag1;
+        saSnapPlMag2     <= prelimProcPlMag2;
+        saSnapPlMag3     <= prelimProcPlMag3;
+        saSnapPhMag0     <= prelimProcPhMag0;
+        saSnapPhMag1     <= prelimProcPhMag1;
+        saSnapPhMag2     <= prelimProcPhMag2;
+        saSnapPhMag3     <= prelimProcPhMag3;
+    end
+end
+assign GPIO_IN[GPIO_IDX_SA_SNAPSHOT_SEQUENCE] = saSnapSequence;
+assign GPIO_IN[GPIO_IDX_SA_TIMESTAMP_SEC]   = saSnapTimestamp[63:32];
+assign GPIO_IN[GPIO_IDX_SA_TIMESTAMP_TICKS] = saSnapTimestamp[31:0];
+assign GPIO_IN[GPIO_IDX_POSITION_CALC_SA_X] = saSnapX;
+assign GPIO_IN[GPIO_IDX_POSITION_CALC_SA_Y] = saSnapY;
+assign GPIO_IN[GPIO_IDX_POSITION_CALC_SA_Q] = saSnapQ;
+assign GPIO_IN[GPIO_IDX_POSITION_CALC_SA_S] = saSnapS;
+assign GPIO_IN[GPIO_IDX_RMS_X_WIDE]   = saSnapWideXrms;
+assign GPIO_IN[GPIO_IDX_RMS_Y_WIDE]   = saSnapWideYrms;
+assign GPIO_IN[GPIO_IDX_RMS_X_NARROW] = saSnapNarrowXrms;
+assign GPIO_IN[GPIO_IDX_RMS_Y_NARROW] = saSnapNarrowYrms;
+assign GPIO_IN[GPIO_IDX_PRELIM_RF_MAG_0] = { magPAD, saSnapRfMag0 };
+assign GPIO_IN[GPIO_IDX_PRELIM_RF_MAG_1] = { magPAD, saSnapRfMag1 };
+assign GPIO_IN[GPIO_IDX_PRELIM_RF_MAG_2] = { magPAD, saSnapRfMag2 };
+assign GPIO_IN[GPIO_IDX_PRELIM_RF_MAG_3] = { magPAD, saSnapRfMag3 };
+assign GPIO_IN[GPIO_IDX_PRELIM_PT_LO_MAG_0] = { magPAD, saSnapPlMag0 };
+assign GPIO_IN[GPIO_IDX_PRELIM_PT_LO_MAG_1] = { magPAD, saSnapPlMag1 };
+assign GPIO_IN[GPIO_IDX_PRELIM_PT_LO_MAG_2] = { magPAD, saSnapPlMag2 };
+assign GPIO_IN[GPIO_IDX_PRELIM_PT_LO_MAG_3] = { magPAD, saSnapPlMag3 };
+assign GPIO_IN[GPIO_IDX_PRELIM_PT_HI_MAG_0] = { magPAD, saSnapPhMag0 };
+assign GPIO_IN[GPIO_IDX_PRELIM_PT_HI_MAG_1] = { magPAD, saSnapPhMag1 };
+assign GPIO_IN[GPIO_IDX_PRELIM_PT_HI_MAG_2] = { magPAD, saSnapPhMag2 };
+assign GPIO_IN[GPIO_IDX_PRELIM_PT_HI_MAG_3] = { magPAD, saSnapPhMag3 };
+
 //
 // Filter FA values before sending to neighbours
 //
@@ -913,7 +964,7 @@ genericWaveformRecorder #(.ACQ_CAPACITY(GPIO_RECORDER_TBT_SAMPLE_CAPACITY))
                       .triggers(recorderTriggerBus),
                       .timestamp(timestamp),
                       .writeData(GPIO_OUT),
-                      .regStrobes(GPIO_STROBES[GPIO_IDX_TBT_RECORDER_BASE+:4]),
+                      .regStrobes(GPIO_STROBES[GPIO_IDX_TBT_RECORDER_BASE+:6]),
                       .csr(tbtWfrCSR),
                       .pretrigCount(tbtWfrPretrigCount),
                       .acqCount(tbtWfrAcqCount),
@@ -964,7 +1015,7 @@ genericWaveformRecorder #(.ACQ_CAPACITY(GPIO_RECORDER_FA_SAMPLE_CAPACITY))
                      .triggers(recorderTriggerBus),
                      .timestamp(timestamp),
                      .writeData(GPIO_OUT),
-                     .regStrobes(GPIO_STROBES[GPIO_IDX_FA_RECORDER_BASE+:4]),
+                     .regStrobes(GPIO_STROBES[GPIO_IDX_FA_RECORDER_BASE+:6]),
                      .csr(faWfrCSR),
                      .pretrigCount(faWfrPretrigCount),
                      .acqCount(faWfrAcqCount),
@@ -1012,7 +1063,7 @@ genericWaveformRecorder #(.ACQ_CAPACITY(GPIO_RECORDER_PT_SAMPLE_CAPACITY))
                      .triggers(recorderTriggerBus),
                      .timestamp(timestamp),
                      .writeData(GPIO_OUT),
-                     .regStrobes(GPIO_STROBES[GPIO_IDX_PL_RECORDER_BASE+:4]),
+                     .regStrobes(GPIO_STROBES[GPIO_IDX_PL_RECORDER_BASE+:6]),
                      .csr(plWfrCSR),
                      .pretrigCount(plWfrPretrigCount),
                      .acqCount(plWfrAcqCount),
@@ -1060,7 +1111,7 @@ genericWaveformRecorder #(.ACQ_CAPACITY(GPIO_RECORDER_PT_SAMPLE_CAPACITY))
                      .triggers(recorderTriggerBus),
                      .timestamp(timestamp),
                      .writeData(GPIO_OUT),
-                     .regStrobes(GPIO_STROBES[GPIO_IDX_PH_RECORDER_BASE+:4]),
+                     .regStrobes(GPIO_STROBES[GPIO_IDX_PH_RECORDER_BASE+:6]),
                      .csr(phWfrCSR),
                      .pretrigCount(phWfrPretrigCount),
                      .acqCount(phWfrAcqCount),
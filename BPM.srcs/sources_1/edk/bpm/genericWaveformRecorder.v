@@ -1,13 +1,22 @@
 //
 // Generic Waveform Recorder
 //
+// In segmented mode the buffer is divided into power-of-two sized
+// regions, each a ring buffer holding one triggered acquisition.
+// Once a segment is complete the recorder waits for the FIFO to drain,
+// records the segment's final write address, then rearms itself for
+// the next segment in the next region.  Writing to the otherwise
+// read-only time stamp registers configures segmentation and selects
+// the segment whose time stamp and final address are read back.
+//
 module genericWaveformRecorder #(
     parameter DATA_WIDTH      = 128,
     parameter TIMESTAMP_WIDTH = 64,
     parameter BUS_WIDTH       = 32,
     parameter AXI_ADDR_WIDTH  = 32,
     parameter AXI_DATA_WIDTH  = 128,
-    parameter ACQ_CAPACITY    = 1 << 23 // Max samples (4 32-bit values/sample)
+    parameter ACQ_CAPACITY    = 1 << 23, // Max samples (4 32-bit values/sample)
+    parameter SEGMENT_INDEX_WIDTH = 6    // Up to 64 segments
     ) (
     input                        clk,
     input       [DATA_WIDTH-1:0] data,
@@ -15,9 +24,9 @@ module genericWaveformRecorder #(
     input                  [7:0] triggers,
     input  [TIMESTAMP_WIDTH-1:0] timestamp,
     input        [BUS_WIDTH-1:0] writeData,
-    input                  [3:0] regStrobes,
+    input                  [5:0] regStrobes,
     output wire       [BUS_WIDTH-1:0] csr, pretrigCount, acqCount, acqAddress,
-    output reg  [TIMESTAMP_WIDTH-1:0] whenTriggered,
+    output wire [TIMESTAMP_WIDTH-1:0] whenTriggered,
 
     output wire [AXI_ADDR_WIDTH-1:0] axi_AWADDR,
     output wire                [7:0] axi_AWLEN,
@@ -57,6 +66,24 @@ reg                         triggerFlag = 0, triggered = 0;
 reg [WRITE_COUNT_WIDTH-1:0] pretrigLeft = 0, acqLeft = 0;
 reg  [WRITE_ADDR_WIDTH-1:0] writeAddr = 0;
 assign axi_AWADDR = { acqBase[31:WRITE_ADDR_WIDTH + 4], writeAddr, 4'b0 };
+
+//
+// Segmentation
+// Write address bits above the shift select the segment region.
+// A shift of 0 places the entire buffer in a single region.
+//
+reg  [SEGMENT_INDEX_WIDTH-1:0] segmentCount_r = 0, segmentsLeft = 0;
+reg  [SEGMENT_INDEX_WIDTH-1:0] segmentIndex = 0, segmentSelect = 0;
+reg                      [4:0] segmentShift_r = 0;
+reg                            segmentDraining = 0, segmentSelected = 0;
+wire    [WRITE_ADDR_WIDTH-1:0] segmentMask = (segmentShift_r == 0) ?
+                                      {WRITE_ADDR_WIDTH{1'b1}} :
+                                    ~({WRITE_ADDR_WIDTH{1'b1}} << segmentShift_r);
+reg      [TIMESTAMP_WIDTH-1:0] segmentWhen [0:(1<<SEGMENT_INDEX_WIDTH)-1];
+reg     [WRITE_ADDR_WIDTH-1:0] segmentEnd [0:(1<<SEGMENT_INDEX_WIDTH)-1];
+reg      [TIMESTAMP_WIDTH-1:0] selectedWhen, firstWhen;
+reg     [WRITE_ADDR_WIDTH-1:0] selectedEnd;
+assign whenTriggered = segmentSelected ? selectedWhen : firstWhen;
 reg [BEATCOUNT_WIDTH-1:0] beatCount;
 assign axi_AWLEN = { {(8-BEATCOUNT_WIDTH){1'b0}}, beatCount };
 assign axi_WLAST = (state == S_DATA) && (beatCount == 0);
@@ -71,10 +98,14 @@ wire csrStrobe = regStrobes[0];
 wire pretrigStrobe = regStrobes[1];
 wire acqCountStrobe = regStrobes[2];
 wire addrStrobe = regStrobes[3];
+wire segmentStrobe = regStrobes[4];
+wire segmentSelectStrobe = regStrobes[5];
 reg [WRITE_COUNT_WIDTH-1:0] pretrigCount_r, acqCount_r;
 assign pretrigCount = { {BUS_WIDTH-WRITE_COUNT_WIDTH{1'b0}}, pretrigCount_r };
 assign acqCount     = { {BUS_WIDTH-WRITE_COUNT_WIDTH{1'b0}}, acqCount_r };
-assign acqAddress   = axi_AWADDR;
+assign acqAddress   = segmentSelected ?
+                { acqBase[31:WRITE_ADDR_WIDTH + 4], selectedEnd, 4'b0 } :
+                axi_AWADDR;
 reg       overrun = 0;
 reg [7:0] csrTriggerEnables = 0;
 reg       csrArmed = 0, full = 0, csrDiagMode = 0;
@@ -92,7 +123,7 @@ wire                       fifo_wr_en, fifo_rd_en;
 wire                       fifoOverflow, fifoEmpty, fifoProgEmpty;
 wire      [DATA_WIDTH-1:0] fifoIn, fifoOut;
 assign fifoIn = csrDiagMode ? {data[DATA_WIDTH-1:BUS_WIDTH], diagCount} : data;
-assign fifo_wr_en = (csrArmed && (dataMatch != dataToggle)
+assign fifo_wr_en = (csrArmed && !segmentDraining && (dataMatch != dataToggle)
                   && (!triggerFlag || (acqLeft != 0)));
 assign fifo_rd_en = (((state == S_ADDR) && axi_AWREADY)
                   || ((state == S_DATA) && (beatCount != 0) && axi_WREADY));
@@ -115,6 +146,16 @@ always @(posedge clk) begin
     if (pretrigStrobe)  pretrigCount_r <= writeData;
     if (acqCountStrobe) acqCount_r     <= writeData;
     if (addrStrobe)     acqBase        <= writeData;
+    if (segmentStrobe) begin
+        segmentCount_r <= writeData[SEGMENT_INDEX_WIDTH-1:0];
+        segmentShift_r <= writeData[12:8];
+    end
+    if (segmentSelectStrobe) begin
+        segmentSelected <= writeData[31];
+        segmentSelect <= writeData[SEGMENT_INDEX_WIDTH-1:0];
+    end
+    selectedWhen <= segmentWhen[segmentSelect];
+    selectedEnd <= segmentEnd[segmentSelect];
     if (csrStrobe) begin
         csrTriggerEnables <= writeData[31:24];
         csrDiagMode <= writeData[8];
@@ -124,11 +165,16 @@ always @(posedge clk) begin
                 writeAddr <= 0;
                 pretrigLeft <= pretrigCount_r;
                 acqLeft <= acqCount_r;
+                segmentsLeft <= segmentCount_r;
+                segmentIndex <= 0;
+                segmentDraining <= 0;
+                segmentSelected <= 0;
                 csrArmed <= 1;
             end
         end
         else begin
             csrArmed <= 0;
+            segmentDraining <= 0;
         end
     end
 
@@ -137,7 +183,7 @@ always @(posedge clk) begin
     //
     triggerReg <= triggers;
     triggerReg_d <= triggerReg;
-    if (csrArmed) begin
+    if (csrArmed && !segmentDraining) begin
         if ((pretrigLeft == 0)
          && ((csrTriggerEnables & triggerReg & ~triggerReg_d) != 0)) begin
             triggerFlag <= 1;
@@ -145,14 +191,16 @@ always @(posedge clk) begin
         if (dataMatch != dataToggle) begin
             if (triggerFlag) begin
                 triggered <= 1;
-                if (!triggered) whenTriggered <= timestamp;
+                if (!triggered) begin
+                    if (segmentIndex == 0) firstWhen <= timestamp;
+                    segmentWhen[segmentIndex] <= timestamp;
+                end
                 if (acqLeft) begin
                     acqLeft <= acqLeft - 1;
                 end
                 else begin
                     if (!csrStrobe) begin
-                        csrArmed <= 0;
-                        full <= 1;
+                        segmentDraining <= 1;
                     end
                 end
             end
@@ -164,11 +212,34 @@ always @(posedge clk) begin
             end
         end
     end
-    else begin
+    else if (!csrArmed) begin
         triggerFlag <= 0;
         triggered <= 0;
     end
 
+    //
+    // Once the segment is in memory note where it ended
+    // and either start the next segment or finish up.
+    //
+    if (csrArmed && segmentDraining && fifoEmpty && (state == S_WAIT)
+     && !csrStrobe) begin
+        segmentEnd[segmentIndex] <= writeAddr;
+        segmentDraining <= 0;
+        if (segmentsLeft) begin
+            segmentsLeft <= segmentsLeft - 1;
+            segmentIndex <= segmentIndex + 1;
+            writeAddr <= (writeAddr | segmentMask) + 1;
+            pretrigLeft <= pretrigCount_r;
+            acqLeft <= acqCount_r;
+            triggerFlag <= 0;
+            triggered <= 0;
+        end
+        else begin
+            csrArmed <= 0;
+            full <= 1;
+        end
+    end
+
     //
     // Acquisition AXI master state machine
     //
@@ -181,7 +252,8 @@ always @(posedge clk) begin
     //
     S_WAIT: begin
         if (!fifoProgEmpty
-         && (writeAddr <= (ACQ_CAPACITY-MULTI_BEAT_LENGTH))) begin
+         && ((writeAddr & segmentMask) <=
+                                 (segmentMask - (MULTI_BEAT_LENGTH-1)))) begin
             beatCount <= MULTI_BEAT_LENGTH-1;
             axi_AWVALID <= 1;
             state <= S_ADDR;
@@ -209,7 +281,8 @@ always @(posedge clk) begin
     //
     S_DATA: begin
         if (axi_WREADY) begin
-            writeAddr <= writeAddr + 1;
+            writeAddr <= (writeAddr & ~segmentMask) |
+                                               ((writeAddr + 1) & segmentMask);
             if (beatCount) begin
                 beatCount <= beatCount - 1;
             end
@@ -25,6 +25,7 @@ parameter GPIO_IDX_POSITION_CALC_SA_X = 24;
 parameter GPIO_IDX_POSITION_CALC_SA_Y = 25;
 parameter GPIO_IDX_POSITION_CALC_SA_Q = 26;
 parameter GPIO_IDX_POSITION_CALC_SA_S = 27;
+parameter GPIO_IDX_SA_SNAPSHOT_SEQUENCE = 28;
 parameter GPIO_IDX_SA_TIMESTAMP_SEC = 30;
 parameter GPIO_IDX_SA_TIMESTAMP_TICKS = 31;
 parameter GPIO_IDX_CELL_COMM_CSR = 32;